@@ -0,0 +1,257 @@
+#include "stdafx.h"
+#include "StringParser.h"
+#include "ExprOptimizer.h"
+#include "FilmWarp.h"
+#include "SyntheticSource.h"
+#include "NullRecorder.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/resource.h>
+#endif
+
+// Renders a fixed catalogue of warps over synthetic clips with
+// FilmWarper::process and compares frames/sec, decoded source frames per
+// output frame and peak memory against a baseline file.
+//
+//     fw_e2ebench [-baseline=path] [-write=1] [-tolerance=0.15] [-filter=text] [-threads=N] [-t=seconds]
+//
+// Each case runs in a child process of its own so that its peak memory is not
+// hidden by the cases before it, and is repeated for at least -t seconds (and
+// five runs) with the median frame rate kept. With -write=1 the results replace the
+// baseline; otherwise the run fails (exit code 1) when a case is slower, or
+// decodes or uses more memory, than the baseline allows.
+
+using namespace std;
+
+namespace
+{
+    struct Warp
+    {
+        const char* name;
+        const char* expression;
+    };
+
+    const Warp warps[] = {
+        { "flip", "[x;h-y;z]" },
+        { "rolling_shutter", "[x;y;z-y*0.1]" },
+        { "cells", "[(4*x)#w;(4*y)#h;z]" },
+        { "reverse", "[x;y;l-z]" },
+        { "slow_motion", "[x;y;z*0.25]" },
+        { "time_scramble", "[x;y;(z*7)#l]" },
+    };
+
+    struct Format
+    {
+        const char* name;
+        int width;
+        int height;
+        int frames;
+    };
+
+    // clips shrink as frames grow so that every case takes a comparable time
+    const Format formats[] = {
+        { "480p", 854, 480, 96 },
+        { "1080p", 1920, 1080, 32 },
+        { "4k", 3840, 2160, 12 },
+    };
+
+    struct Result
+    {
+        string name;
+        double fps;
+        double decodes_per_frame;
+        double peak_mb;
+    };
+
+    double peakMegabytes()
+    {
+#ifdef _WIN32
+        return 0.0;
+#else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1048576.0;
+#else
+        return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+    }
+
+    Result renderOnce(const Warp& warp, const Format& format, int threads)
+    {
+        auto source = make_unique<SyntheticSource>(cv::Size(format.width, format.height), format.frames);
+        SyntheticSource* counter = source.get();
+        Video input(move(source));
+
+        StringParser sp;
+        sp.setConsts(input.width(), input.height(), input.framecount());
+        std::array<std::unique_ptr<Expression3V>, 3> exprs = sp.parseExprTriplet(warp.expression);
+
+        prepareTriplet(exprs, input.width(), input.height(), input.framecount());
+
+        FilmWarper fw;
+        if (threads > 0)
+            fw.setThreads(threads);
+        NullRecorder dest(cv::Size(format.width, format.height), format.frames);
+
+        auto start = chrono::steady_clock::now();
+        fw.process(input, dest, exprs);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        return Result{ string(warp.name) + "@" + format.name, format.frames / seconds,
+            static_cast<double>(counter->decodes()) / format.frames, peakMegabytes() };
+    }
+
+    Result runCase(const Warp& warp, const Format& format, int threads, double seconds)
+    {
+        Result first = renderOnce(warp, format, threads);
+        vector<double> rates{ first.fps };
+        double elapsed = format.frames / first.fps;
+        while ((rates.size() < 5) || (elapsed < seconds))
+        {
+            rates.push_back(renderOnce(warp, format, threads).fps);
+            elapsed += format.frames / rates.back();
+        }
+
+        sort(rates.begin(), rates.end());
+        first.fps = rates[rates.size() / 2];
+        first.peak_mb = peakMegabytes();
+        return first;
+    }
+
+    string formatResult(const Result& r)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%s\t%.3f\t%.3f\t%.1f", r.name.c_str(), r.fps, r.decodes_per_frame, r.peak_mb);
+        return line;
+    }
+
+    bool parseResult(const string& line, Result& r)
+    {
+        istringstream fields(line);
+        return static_cast<bool>(fields >> r.name >> r.fps >> r.decodes_per_frame >> r.peak_mb);
+    }
+
+    // runs one case as `program -case=name` and reads back its result line
+    bool runChild(const string& program, const string& name, int threads, double seconds, Result& r)
+    {
+        string command = "\"" + program + "\" -case=" + name + " -threads=" + to_string(threads) + " -t=" + to_string(seconds);
+        FILE* child = popen(command.c_str(), "r");
+        if (!child)
+            return false;
+
+        char line[256] = {};
+        bool ok = (fgets(line, sizeof(line), child) != nullptr) && parseResult(line, r);
+        return (pclose(child) == 0) && ok;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    map<string, string> params;
+    for (int a = 1; a < argc; a++)
+    {
+        string param = argv[a];
+        if (!param.empty() && param[0] == '-')
+        {
+            int spl = static_cast<int>(param.find('='));
+            params[param.substr(1, spl - 1)] = param.substr(spl + 1);
+        }
+    }
+
+    int threads = (params.find("threads") != params.end()) ? stoi(params["threads"]) : 0;
+    double seconds = (params.find("t") != params.end()) ? stod(params["t"]) : 1.0;
+
+    if (params.find("case") != params.end())
+    {
+        for (const Format& format : formats)
+            for (const Warp& warp : warps)
+                if (string(warp.name) + "@" + format.name == params["case"])
+                {
+                    printf("%s\n", formatResult(runCase(warp, format, threads, seconds)).c_str());
+                    return 0;
+                }
+        return 2;
+    }
+
+    string baseline_path = (params.find("baseline") != params.end()) ? params["baseline"] : "e2e_baseline.tsv";
+    double tolerance = (params.find("tolerance") != params.end()) ? stod(params["tolerance"]) : 0.15;
+    bool write = (params.find("write") != params.end()) && (params["write"] == "1");
+    string filter = (params.find("filter") != params.end()) ? params["filter"] : "";
+
+    map<string, Result> baseline;
+    ifstream in(baseline_path);
+    for (string line; getline(in, line);)
+    {
+        Result r;
+        if (!line.empty() && (line[0] != '#') && parseResult(line, r))
+            baseline[r.name] = r;
+    }
+
+    vector<Result> results;
+    bool regressed = false;
+    printf("%-24s %10s %10s %10s   %s\n", "case", "fps", "dec/frame", "peak MB", "vs baseline");
+
+    for (const Format& format : formats)
+    {
+        for (const Warp& warp : warps)
+        {
+            string name = string(warp.name) + "@" + format.name;
+            if (!filter.empty() && (name.find(filter) == string::npos))
+                continue;
+
+            Result r;
+            if (!runChild(argv[0], name, threads, seconds, r))
+            {
+                printf("%-24s failed\n", name.c_str());
+                regressed = true;
+                continue;
+            }
+            results.push_back(r);
+
+            string verdict = "no baseline";
+            auto base = baseline.find(name);
+            if (base != baseline.end())
+            {
+                const Result& b = base->second;
+                verdict.clear();
+                if (r.fps < b.fps * (1.0 - tolerance))
+                    verdict += " fps";
+                // decode counts are exact; a small absolute slack absorbs rounding in the file
+                if (r.decodes_per_frame > b.decodes_per_frame * (1.0 + tolerance) + 0.01)
+                    verdict += " decodes";
+                if ((b.peak_mb > 0.0) && (r.peak_mb > b.peak_mb * (1.0 + tolerance)))
+                    verdict += " memory";
+                regressed |= !verdict.empty();
+                verdict = verdict.empty() ? "ok" : ("REGRESSED:" + verdict);
+            }
+
+            printf("%-24s %10.2f %10.3f %10.1f   %s\n", name.c_str(), r.fps, r.decodes_per_frame, r.peak_mb, verdict.c_str());
+            fflush(stdout);
+        }
+    }
+
+    if (write)
+    {
+        // cases left out by -filter keep their previous baseline
+        for (const Result& r : results)
+            baseline[r.name] = r;
+
+        ofstream out(baseline_path);
+        out << "# case\tfps\tdecodes_per_frame\tpeak_mb\n";
+        for (auto& entry : baseline)
+            out << formatResult(entry.second) << "\n";
+        printf("baseline written to %s\n", baseline_path.c_str());
+        return 0;
+    }
+
+    return regressed ? 1 : 0;
+}
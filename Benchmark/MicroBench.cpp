@@ -0,0 +1,347 @@
+#include "stdafx.h"
+#include "StringParser.h"
+#include "ExprOptimizer.h"
+#include "AllocCounter.h"
+#include "FilmWarp.h"
+#include "SyntheticSource.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+// Times FilmWarp's hot kernels in isolation on synthetic in-memory data and
+// prints, per kernel, the time per output pixel and the heap allocations per
+// frame once the span pools have warmed up. It also compares the fixed-point
+// and AVX2 samplers with the scalar float one at random coordinates and
+// fails (exit code 1) when a channel is further off than sampler_tolerance.
+//
+//     fw_microbench [-s=WxH] [-t=seconds] [-filter=text]
+
+using namespace std;
+
+namespace
+{
+    struct Options
+    {
+        int    width = 640;
+        int    height = 360;
+        double seconds = 0.2;
+        string filter;
+    };
+
+    Options options;
+    volatile unsigned sink;
+    bool failed = false;
+
+    // levels per channel: the fixed-point sampler's three blends (along x, y
+    // and z) each truncate both their 8-bit weight and their result
+    const int sampler_tolerance = 3;
+
+    template<class F> void measure(const string& name, F frame)
+    {
+        if (!options.filter.empty() && (name.find(options.filter) == string::npos))
+            return;
+
+        typedef chrono::steady_clock clock;
+        frame();
+
+        size_t allocations = heapAllocationCount();
+        clock::time_point start = clock::now();
+        int frames = 0;
+        double elapsed = 0.0;
+        while ((frames < 3) || (elapsed < options.seconds))
+        {
+            frame();
+            frames++;
+            elapsed = chrono::duration<double>(clock::now() - start).count();
+        }
+        allocations = heapAllocationCount() - allocations;
+
+        double pixels = static_cast<double>(options.width) * options.height * frames;
+        printf("%-44s %10.3f ns/px %8.2f allocs/frame\n", name.c_str(), elapsed * 1e9 / pixels,
+            static_cast<double>(allocations) / frames);
+    }
+
+    const char* typeName(SpanType type)
+    {
+        switch (type)
+        {
+        case SpanType::Dense:        return "Dense";
+        case SpanType::Sparse:       return "Sparse";
+        case SpanType::SparseLinear: return "SparseLinear";
+        case SpanType::Affine2D:     return "Affine2D";
+        }
+        return "";
+    }
+
+    const SpanType span_types[] = { SpanType::Dense, SpanType::Sparse, SpanType::SparseLinear, SpanType::Affine2D };
+
+    // spans shaped like the coordinate planes they stand for: noise, runs of
+    // 16 equal values, one ramp per row, and an affine plane
+    template<class T> SmartSpan<T> makeSpan(SpanType type)
+    {
+        int width = options.width;
+        int size = options.width * options.height;
+        switch (type)
+        {
+        case SpanType::Dense:
+        {
+            SmartSpan<T> span(SpanType::Dense, size, size, 0);
+            for (int i = 0; i < size; i++)
+                span.data.push_back(static_cast<T>((i * 37) % 101 + 1));
+            return span;
+        }
+        case SpanType::Sparse:
+        {
+            SmartSpan<T> span(SpanType::Sparse, size, size / 16 + 1, size / 16 + 2);
+            span.offsets.push_back(0);
+            for (int i = 0; i < size; i += 16)
+            {
+                span.data.push_back(static_cast<T>((i / 16) % 13 + 1));
+                span.offsets.push_back(min(i + 16, size));
+            }
+            return span;
+        }
+        case SpanType::SparseLinear:
+        {
+            int rows = options.height;
+            SmartSpan<T> span(SpanType::SparseLinear, size, 2 * rows, rows + 1);
+            span.offsets.push_back(0);
+            for (int row = 0; row < rows; row++)
+            {
+                span.data.push_back(static_cast<T>(row - width / 2));
+                span.data.push_back(static_cast<T>(2));
+                span.offsets.push_back((row + 1) * width);
+            }
+            return span;
+        }
+        default:
+            return affine_span(size, width, static_cast<T>(3), static_cast<T>(1), static_cast<T>(2));
+        }
+    }
+
+    template<class T> void benchSpans(const char* type)
+    {
+        string prefix = string("span<") + type + "> ";
+        for (SpanType a : span_types)
+        {
+            SmartSpan<T> sa = makeSpan<T>(a);
+            measure(prefix + "copy " + typeName(a), [&]()
+            {
+                SmartSpan<T> r(sa);
+                sink = static_cast<unsigned>(r.data[0]);
+            });
+        }
+
+        for (SpanType a : span_types)
+        {
+            for (SpanType b : span_types)
+            {
+                SmartSpan<T> sa = makeSpan<T>(a), sb = makeSpan<T>(b);
+                string pair = string(typeName(a)) + "," + typeName(b);
+
+                measure(prefix + "add " + pair, [&]()
+                {
+                    SmartSpan<T> r = SmartSpan<T>(sa) + SmartSpan<T>(sb);
+                    sink = static_cast<unsigned>(r.data[0]);
+                });
+                measure(prefix + "mult " + pair, [&]()
+                {
+                    SmartSpan<T> r = SmartSpan<T>(sa) * SmartSpan<T>(sb);
+                    sink = static_cast<unsigned>(r.data[0]);
+                });
+                measure(prefix + "generic " + pair, [&]()
+                {
+                    SmartSpan<T> r(sa);
+                    generic_op(r, sb, [](T p, T q) { return p - q; });
+                    sink = static_cast<unsigned>(r.data[0]);
+                });
+            }
+        }
+
+        SmartSpan<T> ramps = makeSpan<T>(SpanType::SparseLinear);
+        measure(prefix + "sparselinear_clamp", [&]()
+        {
+            SmartSpan<T> r(ramps);
+            sparselinear_clamp<T>(r, static_cast<T>(0), static_cast<T>(options.width - 1));
+            sink = static_cast<unsigned>(r.data[0]);
+        });
+
+        for (SpanType a : span_types)
+        {
+            if (a == SpanType::Dense)
+                continue;
+            SmartSpan<T> sa = makeSpan<T>(a);
+            measure(prefix + "to_dense " + typeName(a), [&]()
+            {
+                SmartSpan<T> r(sa);
+                r.to_dense();
+                sink = static_cast<unsigned>(r.data[0]);
+            });
+        }
+    }
+
+    // a fixed fractional offset keeps every interpolating overload on its slow path
+    template<class F> void benchPixel(const string& name, F sample)
+    {
+        measure("Video::pixel" + name, [&]()
+        {
+            unsigned sum = 0;
+            for (int y = 0; y < options.height; y++)
+                for (int x = 0; x < options.width; x++)
+                    sum += compress(sample(x, y)).r;
+            sink = sum;
+        });
+    }
+
+    // largest per-channel difference from the scalar sampler over random
+    // coordinates covering the loaded frames, edges included
+    void compareSampler(const Video& v, SamplerKind kind, const string& kind_name)
+    {
+        string name = "sampleRow error " + kind_name;
+        if (!options.filter.empty() && (name.find(options.filter) == string::npos))
+            return;
+
+        const int rows = 256;
+        mt19937 random(7);
+        uniform_real_distribution<float> rx(0.f, static_cast<float>(options.width - 1));
+        uniform_real_distribution<float> ry(0.f, static_cast<float>(options.height - 1));
+        uniform_real_distribution<float> rz(0.f, 3.f);
+
+        vector<float> xs(options.width), ys(options.width), zs(options.width);
+        vector<unsigned char> reference(3 * options.width), row(3 * options.width);
+        int worst = 0;
+        for (int r = 0; r < rows; r++)
+        {
+            for (int x = 0; x < options.width; x++)
+            {
+                xs[x] = rx(random);
+                ys[x] = ry(random);
+                zs[x] = rz(random);
+            }
+            sampleRow(SamplerKind::Scalar, v, xs.data(), ys.data(), zs.data(), options.width, reference.data());
+            sampleRow(kind, v, xs.data(), ys.data(), zs.data(), options.width, row.data());
+            for (size_t i = 0; i < row.size(); i++)
+                worst = max(worst, abs(row[i] - reference[i]));
+        }
+
+        bool ok = (worst <= sampler_tolerance);
+        failed |= !ok;
+        printf("%-44s %10d levels  %s\n", name.c_str(), worst, ok ? "ok" : "EXCEEDS TOLERANCE");
+    }
+
+    void benchVideo()
+    {
+        Video video(make_unique<SyntheticSource>(cv::Size(options.width, options.height), 4));
+        video.loadFrames({ 0, 1, 2, 3 });
+        const Video& v = video;
+
+        float dx = 0.37f, dy = 0.61f, dz = 0.29f;
+        benchPixel("(int,int,int)", [&](int x, int y) { return v.pixel(x, y, 1); });
+        benchPixel("(float,int,int)", [&](int x, int y) { return v.pixel(x + dx, y, 1); });
+        benchPixel("(float,float,int)", [&](int x, int y) { return v.pixel(x + dx, y + dy, 1); });
+        benchPixel("(float,float,float)", [&](int x, int y) { return v.pixel(x + dx, y + dy, 1 + dz); });
+        benchPixel("(int,int,float)", [&](int x, int y) { return v.pixel(x, y, 1 + dz); });
+
+        vector<float> xs(options.width), ys(options.width), zs(options.width);
+        vector<unsigned char> row(3 * options.width);
+        vector<pair<SamplerKind, string>> kinds{ { SamplerKind::Scalar, "scalar" }, { SamplerKind::Fixed, "fixed" } };
+        if (cpuSupportsAVX2())
+            kinds.push_back({ SamplerKind::AVX2, "avx2" });
+
+        for (auto& kind : kinds)
+        {
+            measure("sampleRow trilinear " + kind.second, [&]()
+            {
+                for (int y = 0; y < options.height; y++)
+                {
+                    for (int x = 0; x < options.width; x++)
+                    {
+                        xs[x] = x * 0.999f;
+                        ys[x] = y + dy;
+                        zs[x] = 1 + dz;
+                    }
+                    sampleRow(kind.first, v, xs.data(), ys.data(), zs.data(), options.width, row.data());
+                }
+                sink = row[0];
+            });
+        }
+
+        for (auto& kind : kinds)
+            if (kind.first != SamplerKind::Scalar)
+                compareSampler(v, kind.first, kind.second);
+    }
+
+    // the examples from the README, prepared the way main() prepares them
+    void benchExpressions()
+    {
+        const char* examples[] = { "[x;h-y;z]", "[x;y;z-y*0.1]", "[(4*x)#w;(4*y)#h;z]", "[x;y;l-z]" };
+        int frames = 100;
+        int pixels = options.width * options.height;
+
+        SmartSpan<int> coord_x = affine_span(pixels, options.width, 0, 1, 0);
+        SmartSpan<int> coord_y = affine_span(pixels, options.width, 0, 0, 1);
+        SmartSpan<float> coord_xf = affine_span(pixels, options.width, 0.f, 1.f, 0.f);
+        SmartSpan<float> coord_yf = affine_span(pixels, options.width, 0.f, 0.f, 1.f);
+
+        for (const char* example : examples)
+        {
+            StringParser sp;
+            sp.setConsts(options.width, options.height, frames);
+            std::array<std::unique_ptr<Expression3V>, 3> exprs = sp.parseExprTriplet(example);
+
+            prepareTriplet(exprs, options.width, options.height, frames);
+
+            for (auto& expr : exprs)
+            {
+                expr->setVars(&coord_x, &coord_y);
+                expr->setVars(&coord_xf, &coord_yf);
+            }
+
+            int f = 0;
+            measure(string("Expression3V ") + example, [&]()
+            {
+                for (auto& expr : exprs)
+                {
+                    expr->setZ(f);
+                    expr->setZ(static_cast<float>(f));
+                }
+                for (auto& expr : exprs)
+                    apply_result(expr, [](auto span) { sink = static_cast<unsigned>(span.data[0]); });
+                f = (f + 1) % frames;
+            });
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    for (int a = 1; a < argc; a++)
+    {
+        string param = argv[a];
+        size_t split = param.find('=');
+        if ((param.size() < 2) || (param[0] != '-') || (split == string::npos))
+            continue;
+
+        string name = param.substr(1, split - 1);
+        string value = param.substr(split + 1);
+        if (name == "s")
+        {
+            options.width = stoi(value);
+            options.height = stoi(value.substr(value.find('x') + 1));
+        }
+        else if (name == "t")
+            options.seconds = stod(value);
+        else if (name == "filter")
+            options.filter = value;
+    }
+
+    printf("# %dx%d, %.2f s per kernel\n", options.width, options.height, options.seconds);
+
+    benchSpans<int>("int");
+    benchSpans<float>("float");
+    benchVideo();
+    benchExpressions();
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Consumes frames without encoding them, so that only the warp itself is
+// timed or measured; keeps a checksum of one pixel per frame.
+class NullRecorder : public Recorder
+{
+    cv::Mat buffer;
+public:
+    unsigned checksum = 0;
+
+    NullRecorder(cv::Size res, int frames) : Recorder(0, 25.0, res, frames) {}
+
+    virtual cv::Mat acquireFrame()
+    {
+        if (buffer.empty())
+            buffer.create(cv::Size(width(), height()), CV_8UC3);
+        return buffer;
+    }
+
+    virtual void submitFrame(cv::Mat& frame)
+    {
+        checksum = checksum * 31 + frame.ptr(frame.rows / 2)[frame.cols / 2 * 3];
+    }
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+// Deterministic BGR frames generated in memory, standing in for a decoder.
+// Frame f has B = 7x + 3f, G = 5y + f and R = x + y + 11f (mod 256), so every
+// frame differs and interpolation has gradients to work on.
+class SyntheticSource : public FrameSource
+{
+    cv::Size resolution;
+    int      frames;
+    int      position = 0;
+    long long decoded = 0;
+public:
+    SyntheticSource(cv::Size res, int frames_) : resolution(res), frames(frames_) {}
+
+    virtual void read(cv::Mat& frame)
+    {
+        if (position >= frames)
+        {
+            frame.release();
+            return;
+        }
+
+        frame.create(resolution, CV_8UC3);
+        for (int y = 0; y < resolution.height; y++)
+        {
+            unsigned char* p = frame.ptr(y);
+            for (int x = 0; x < resolution.width; x++, p += 3)
+            {
+                p[0] = static_cast<unsigned char>(x * 7 + position * 3);
+                p[1] = static_cast<unsigned char>(y * 5 + position);
+                p[2] = static_cast<unsigned char>(x + y + position * 11);
+            }
+        }
+        position++;
+        decoded++;
+    }
+
+    // skipping a frame of a real video still decodes it
+    virtual void grab() { position++; decoded++; }
+    virtual bool seek(int frame) { position = frame; return true; }
+    virtual bool rewind() { position = 0; return true; }
+    virtual bool streaming() const { return false; }
+
+    virtual cv::Size size() const { return resolution; }
+    virtual double fps() const { return 25.0; }
+    virtual int framecount() const { return frames; }
+    virtual int fourcc() const { return 0; }
+
+    // frames read or skipped so far
+    long long decodes() const { return decoded; }
+};
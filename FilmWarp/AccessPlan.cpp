@@ -0,0 +1,162 @@
+#include "stdafx.h"
+#include "AccessPlan.h"
+
+#include <set>
+#include <climits>
+
+using namespace std;
+
+namespace
+{
+    vector<int> unite(const vector<int>& frames, FrameNeed need)
+    {
+        vector<int> range(need.last - need.first + 1);
+        iota(range.begin(), range.end(), need.first);
+
+        vector<int> result;
+        result.reserve(frames.size() + range.size());
+        set_union(frames.begin(), frames.end(), range.begin(), range.end(), back_inserter(result));
+        return result;
+    }
+}
+
+std::vector<AccessStep> planAccess(const std::vector<FrameNeed>& needs, int capacity, int max_batch, int skip_limit)
+{
+    vector<AccessStep> steps;
+    vector<vector<int>> working;
+
+    for (int begin = 0, end; begin < static_cast<int>(needs.size()); begin = end)
+    {
+        vector<int> frames = unite({}, needs[begin]);
+        for (end = begin + 1; (end < static_cast<int>(needs.size())) && (end - begin < max_batch); end++)
+        {
+            vector<int> merged = unite(frames, needs[end]);
+            if ((merged.size() > frames.size()) && (static_cast<int>(merged.size()) > capacity))
+                break;
+            frames = move(merged);
+        }
+
+        steps.push_back(AccessStep{ begin, end, {}, {} });
+        working.push_back(move(frames));
+    }
+
+    // steps that need each frame, ascending
+    unordered_map<int, vector<int>> uses;
+    for (int k = 0; k < static_cast<int>(steps.size()); k++)
+        for (int frame : working[k])
+            uses[frame].push_back(k);
+
+    auto nextUse = [&uses](int frame, int k)
+    {
+        auto found = uses.find(frame);
+        if (found == uses.end())
+            return INT_MAX;
+        auto it = upper_bound(found->second.begin(), found->second.end(), k);
+        return (it == found->second.end()) ? INT_MAX : *it;
+    };
+
+    // resident frames keyed by their next use; while step k is planned, its own
+    // working set is keyed k so that it cannot be evicted
+    unordered_map<int, int> resident;
+    set<pair<int, int>> by_next_use;
+
+    auto admit = [&](int frame, int next)
+    {
+        auto it = resident.find(frame);
+        if (it != resident.end())
+            by_next_use.erase({ it->second, frame });
+        resident[frame] = next;
+        by_next_use.insert({ next, frame });
+    };
+
+    auto evictLast = [&](int k)
+    {
+        auto last = prev(by_next_use.end());
+        steps[k].evict.push_back(last->second);
+        resident.erase(last->second);
+        by_next_use.erase(last);
+    };
+
+    // the frame the decoder reads next
+    int position = 0;
+
+    for (int k = 0; k < static_cast<int>(steps.size()); k++)
+    {
+        AccessStep& current = steps[k];
+        for (int frame : working[k])
+            if (!resident.count(frame))
+                current.load.push_back(frame);
+
+        int overflow = static_cast<int>(resident.size() + current.load.size()) - capacity;
+        while (!by_next_use.empty())
+        {
+            int last_use = prev(by_next_use.end())->first;
+            if ((last_use <= k) || ((last_use != INT_MAX) && (overflow <= 0)))
+                break;
+            evictLast(k);
+            overflow--;
+        }
+
+        for (int frame : working[k])
+            admit(frame, k);
+
+        // frames between two loads, and between the decoder and the first load,
+        // are decoded anyway; keep the ones needed later while they fit, or
+        // while they are needed sooner than a resident frame
+        vector<pair<int, int>> passed;
+        auto pass = [&](int from, int to)
+        {
+            for (int frame = from; frame < to; frame++)
+            {
+                int next = nextUse(frame, k);
+                if ((next != INT_MAX) && !resident.count(frame))
+                    passed.push_back({ next, frame });
+            }
+        };
+        if (!current.load.empty() && (current.load[0] >= position) && (current.load[0] - position <= skip_limit))
+            pass(position, current.load[0]);
+        for (size_t i = 1; i < current.load.size(); i++)
+        {
+            if (current.load[i] - current.load[i - 1] > skip_limit)
+                continue;
+            pass(current.load[i - 1] + 1, current.load[i]);
+        }
+        sort(passed.begin(), passed.end());
+
+        for (auto& candidate : passed)
+        {
+            if (static_cast<int>(resident.size()) >= capacity)
+            {
+                int last_use = prev(by_next_use.end())->first;
+                if ((last_use <= candidate.first) || (last_use <= k))
+                    break;
+                evictLast(k);
+            }
+            admit(candidate.second, candidate.first);
+            current.load.push_back(candidate.second);
+        }
+        sort(current.load.begin(), current.load.end());
+        if (!current.load.empty())
+            position = current.load.back() + 1;
+
+        for (int frame : working[k])
+            admit(frame, nextUse(frame, k));
+    }
+
+    return steps;
+}
+
+int lookBack(const std::vector<FrameNeed>& needs, const std::vector<AccessStep>& plan)
+{
+    // a step reads up to the last frame any of its outputs needs
+    int read = 0;
+    int window = 0;
+    for (const AccessStep& step : plan)
+    {
+        for (int f = step.out_begin; f < step.out_end; f++)
+            read = max(read, needs[f].last + 1);
+        for (int f = step.out_begin; f < step.out_end; f++)
+            window = max(window, read - needs[f].first);
+    }
+    return window;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+// Source frames [first, last] sampled by one output frame.
+struct FrameNeed
+{
+    int first;
+    int last;
+};
+
+// Output frames [out_begin, out_end) are rendered once the frames in `evict`
+// have been released and the frames in `load` (ascending) have been decoded.
+struct AccessStep
+{
+    int out_begin;
+    int out_end;
+    std::vector<int> evict;
+    std::vector<int> load;
+};
+
+// Schedules the source accesses of a whole render. Consecutive output frames
+// share a step while their combined working set fits into `capacity` frames
+// (or does not grow), up to `max_batch` outputs per step; the working sets of
+// different steps need not be contiguous. Frames that are never needed again
+// are dropped first, then the resident frame whose next use lies furthest
+// ahead (Belady's rule), until the next working set fits. Gaps of up to
+// `skip_limit` frames between loads, or between the decoder's position and a
+// step's first load, are decoded through rather than seeked over, so frames in
+// them that are needed later are kept when that beats a resident frame by the
+// same rule.
+std::vector<AccessStep> planAccess(const std::vector<FrameNeed>& needs, int capacity, int max_batch, int skip_limit);
+
+// How many of the most recently read frames a source that is read only
+// forwards must keep for `plan` to find every frame it needs.
+int lookBack(const std::vector<FrameNeed>& needs, const std::vector<AccessStep>& plan);
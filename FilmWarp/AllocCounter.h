@@ -0,0 +1,6 @@
+#pragma once
+
+// Number of calls to the global operator new since start-up; lets a run check
+// that steady-state frames do not touch the heap (-allocstats=1 and the
+// steady_state_allocations test).
+size_t heapAllocationCount();
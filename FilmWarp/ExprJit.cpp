@@ -0,0 +1,343 @@
+#include "stdafx.h"
+#include "ExprJit.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define FW_JIT_X64
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+#ifdef FW_JIT_X64
+
+namespace
+{
+    // Register usage of the generated code (volatile on both Win64 and SysV):
+    // rax = JitContext*, r8 = xs, r9 = register file, r10 = output row pointers,
+    // r11 = row length in bytes, rdx = byte offset of the current 4-pixel group,
+    // rcx = scratch, xmm0..xmm5 = scratch.
+    class Assembler
+    {
+        vector<unsigned char> bytes;
+
+        void imm32(unsigned v)
+        {
+            for (int k = 0; k < 4; k++)
+                bytes.push_back(static_cast<unsigned char>(v >> (8 * k)));
+        }
+
+    public:
+        const vector<unsigned char>& code() const { return bytes; }
+        size_t position() const { return bytes.size(); }
+
+        void raw(initializer_list<unsigned char> b)
+        {
+            bytes.insert(bytes.end(), b.begin(), b.end());
+        }
+
+        // <opcode> xmm(reg), xmm(rm)
+        void rr(initializer_list<unsigned char> opcode, int reg, int rm)
+        {
+            raw(opcode);
+            bytes.push_back(static_cast<unsigned char>(0xC0 | (reg << 3) | rm));
+        }
+
+        void rri(initializer_list<unsigned char> opcode, int reg, int rm, unsigned char imm)
+        {
+            rr(opcode, reg, rm);
+            bytes.push_back(imm);
+        }
+
+        // movups xmm, [r9 + 16*r]
+        void loadRegister(int xmm, int r)
+        {
+            raw({ 0x41, 0x0F, 0x10, static_cast<unsigned char>(0x81 | (xmm << 3)) });
+            imm32(16 * r);
+        }
+
+        // movups [r9 + 16*r], xmm
+        void storeRegister(int r, int xmm)
+        {
+            raw({ 0x41, 0x0F, 0x11, static_cast<unsigned char>(0x81 | (xmm << 3)) });
+            imm32(16 * r);
+        }
+
+        // movups xmm, [r8 + rdx]
+        void loadColumns(int xmm)
+        {
+            raw({ 0x41, 0x0F, 0x10, static_cast<unsigned char>(0x04 | (xmm << 3)), 0x10 });
+        }
+
+        // movd xmm, [rax + disp8]; pshufd xmm, xmm, 0
+        void broadcastContext(int xmm, unsigned char disp)
+        {
+            raw({ 0x66, 0x0F, 0x6E, static_cast<unsigned char>(0x40 | (xmm << 3)), disp });
+            rri({ 0x66, 0x0F, 0x70 }, xmm, xmm, 0);
+        }
+
+        // mov ecx, imm32; movd xmm, ecx; pshufd xmm, xmm, 0
+        void broadcastImmediate(int xmm, unsigned bits)
+        {
+            raw({ 0xB9 });
+            imm32(bits);
+            rr({ 0x66, 0x0F, 0x6E }, xmm, 1);
+            rri({ 0x66, 0x0F, 0x70 }, xmm, xmm, 0);
+        }
+
+        // mov rcx, [r10 + 8*k]; movups [rcx + rdx], xmm
+        void storeOutput(int k, int xmm)
+        {
+            raw({ 0x49, 0x8B, 0x8A });
+            imm32(8 * k);
+            raw({ 0x0F, 0x11, static_cast<unsigned char>(0x04 | (xmm << 3)), 0x11 });
+        }
+
+        void prologue()
+        {
+#ifdef _WIN32
+            raw({ 0x48, 0x89, 0xC8 });             // mov rax, rcx
+#else
+            raw({ 0x48, 0x89, 0xF8 });             // mov rax, rdi
+#endif
+            raw({ 0x4C, 0x8B, 0x40, offsetof(JitContext, xs) });
+            raw({ 0x4C, 0x8B, 0x48, offsetof(JitContext, regs) });
+            raw({ 0x4C, 0x8B, 0x50, offsetof(JitContext, outputs) });
+            raw({ 0x4C, 0x8B, 0x58, offsetof(JitContext, n_bytes) });
+            raw({ 0x31, 0xD2 });                   // xor edx, edx
+        }
+
+        // cmp rdx, r11; jge <patched later>
+        size_t loopHead()
+        {
+            raw({ 0x4C, 0x39, 0xDA, 0x0F, 0x8D });
+            imm32(0);
+            return position();
+        }
+
+        // add rdx, 16; jmp head; ret
+        void loopTail(size_t head_end)
+        {
+            raw({ 0x48, 0x83, 0xC2, 0x10, 0xE9 });
+            imm32(static_cast<unsigned>(static_cast<long long>(head_end) - 9 - static_cast<long long>(position() + 4)));
+            size_t exit = position();
+            unsigned rel = static_cast<unsigned>(exit - head_end);
+            for (int k = 0; k < 4; k++)
+                bytes[head_end - 4 + k] = static_cast<unsigned char>(rel >> (8 * k));
+            raw({ 0xC3 });
+        }
+    };
+
+    void emitIntDivide(Assembler& as)
+    {
+        // xmm2 = trunc(xmm0 / xmm1) through two double-precision halves (exact for int32)
+        as.rr({ 0xF3, 0x0F, 0xE6 }, 2, 0);         // cvtdq2pd xmm2, xmm0
+        as.rr({ 0xF3, 0x0F, 0xE6 }, 3, 1);         // cvtdq2pd xmm3, xmm1
+        as.rr({ 0x66, 0x0F, 0x5E }, 2, 3);         // divpd xmm2, xmm3
+        as.rr({ 0x66, 0x0F, 0xE6 }, 2, 2);         // cvttpd2dq xmm2, xmm2
+        as.rri({ 0x66, 0x0F, 0x70 }, 4, 0, 0xEE);  // pshufd xmm4, xmm0, 0xEE
+        as.rri({ 0x66, 0x0F, 0x70 }, 5, 1, 0xEE);  // pshufd xmm5, xmm1, 0xEE
+        as.rr({ 0xF3, 0x0F, 0xE6 }, 4, 4);         // cvtdq2pd xmm4, xmm4
+        as.rr({ 0xF3, 0x0F, 0xE6 }, 5, 5);         // cvtdq2pd xmm5, xmm5
+        as.rr({ 0x66, 0x0F, 0x5E }, 4, 5);         // divpd xmm4, xmm5
+        as.rr({ 0x66, 0x0F, 0xE6 }, 4, 4);         // cvttpd2dq xmm4, xmm4
+        as.rr({ 0x66, 0x0F, 0x6C }, 2, 4);         // punpcklqdq xmm2, xmm4
+        as.rr({ 0x66, 0x0F, 0x38, 0x40 }, 2, 1);   // pmulld xmm2, xmm1
+    }
+
+    void emitFloatDivide(Assembler& as)
+    {
+        // xmm2 = floor(xmm0 / xmm1) * xmm1
+        as.rr({ 0x0F, 0x28 }, 2, 0);               // movaps xmm2, xmm0
+        as.rr({ 0x0F, 0x5E }, 2, 1);               // divps xmm2, xmm1
+        as.rri({ 0x66, 0x0F, 0x3A, 0x08 }, 2, 2, 0x09); // roundps xmm2, xmm2, floor
+        as.rr({ 0x0F, 0x59 }, 2, 1);               // mulps xmm2, xmm1
+    }
+
+    // Emits one instruction; returns the xmm register holding the result.
+    int emitInstruction(Assembler& as, const Instruction& ins, bool floating)
+    {
+        if (ins.a >= 0)
+            as.loadRegister(0, ins.a);
+        if (ins.b >= 0)
+            as.loadRegister(1, ins.b);
+
+        auto imm = [&](int k) { return floating ? bitsOf(ins.fval[k]) : bitsOf(ins.ival[k]); };
+
+        switch (ins.op)
+        {
+        case OpCode::LoadX: as.loadColumns(0); return 0;
+        case OpCode::LoadY: as.broadcastContext(0, offsetof(JitContext, y_bits)); return 0;
+        case OpCode::LoadZ: as.broadcastContext(0, offsetof(JitContext, z_bits)); return 0;
+        case OpCode::Const: as.broadcastImmediate(0, imm(0)); return 0;
+
+        case OpCode::Add:
+            if (floating) as.rr({ 0x0F, 0x58 }, 0, 1);
+            else          as.rr({ 0x66, 0x0F, 0xFE }, 0, 1);
+            return 0;
+
+        case OpCode::Scale:
+            as.broadcastImmediate(1, imm(0));
+            // fall through
+        case OpCode::Mul:
+            if (floating) as.rr({ 0x0F, 0x59 }, 0, 1);
+            else          as.rr({ 0x66, 0x0F, 0x38, 0x40 }, 0, 1);
+            return 0;
+
+        case OpCode::Div:
+            if (floating) as.rr({ 0x0F, 0x5E }, 0, 1);
+            else          as.rr({ 0x0F, 0x57 }, 0, 0);
+            return 0;
+
+        case OpCode::Mod:
+            if (floating)
+            {
+                emitFloatDivide(as);
+                as.rr({ 0x0F, 0x5C }, 0, 2);       // subps xmm0, xmm2
+            }
+            else
+            {
+                emitIntDivide(as);
+                as.rr({ 0x66, 0x0F, 0xFA }, 0, 2); // psubd xmm0, xmm2
+            }
+            return 0;
+
+        case OpCode::Floor:
+            if (floating)
+                emitFloatDivide(as);
+            else
+                emitIntDivide(as);
+            return 2;
+
+        case OpCode::Clamp:
+            as.broadcastImmediate(1, imm(0));
+            as.broadcastImmediate(2, imm(1));
+            if (floating)
+            {
+                // (lo > v) ? lo : v, then (hi < t) ? hi : t, the same choices clamp() makes
+                as.rr({ 0x0F, 0x5F }, 1, 0);       // maxps xmm1, xmm0
+                as.rr({ 0x0F, 0x5D }, 2, 1);       // minps xmm2, xmm1
+                return 2;
+            }
+            as.rr({ 0x66, 0x0F, 0x38, 0x3D }, 0, 1); // pmaxsd xmm0, xmm1
+            as.rr({ 0x66, 0x0F, 0x38, 0x39 }, 0, 2); // pminsd xmm0, xmm2
+            return 0;
+        }
+        return 0;
+    }
+
+    bool cpuSupportsSSE41()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 19)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.1") != 0;
+#endif
+    }
+
+    void* allocateExecutable(const vector<unsigned char>& bytes)
+    {
+#ifdef _WIN32
+        void* mem = VirtualAlloc(nullptr, bytes.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!mem)
+            return nullptr;
+        memcpy(mem, bytes.data(), bytes.size());
+        DWORD old_protect;
+        if (!VirtualProtect(mem, bytes.size(), PAGE_EXECUTE_READ, &old_protect))
+        {
+            VirtualFree(mem, 0, MEM_RELEASE);
+            return nullptr;
+        }
+        FlushInstructionCache(GetCurrentProcess(), mem, bytes.size());
+        return mem;
+#else
+        void* mem = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return nullptr;
+        memcpy(mem, bytes.data(), bytes.size());
+        if (mprotect(mem, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(mem, bytes.size());
+            return nullptr;
+        }
+        return mem;
+#endif
+    }
+
+    void releaseExecutable(void* mem, size_t size)
+    {
+#ifdef _WIN32
+        VirtualFree(mem, 0, MEM_RELEASE);
+#else
+        munmap(mem, size);
+#endif
+    }
+}
+
+bool ExprJit::available()
+{
+    return cpuSupportsSSE41();
+}
+
+ExprJit::ExprJit(const ExprProgram& program, bool floating)
+    : code(nullptr), code_size(0), entry(nullptr), registers(program.registerCount()),
+    results(static_cast<int>(program.results().size()))
+{
+    if (!available())
+        return;
+
+    Assembler as;
+    as.prologue();
+    size_t head = as.loopHead();
+
+    for (const Instruction& ins : program.instructions())
+        as.storeRegister(ins.dst, emitInstruction(as, ins, floating));
+
+    for (int k = 0; k < results; k++)
+    {
+        as.loadRegister(0, program.results()[k]);
+        as.storeOutput(k, 0);
+    }
+
+    as.loopTail(head);
+
+    code = allocateExecutable(as.code());
+    if (!code)
+        return;
+    code_size = as.code().size();
+    entry = reinterpret_cast<Entry>(code);
+}
+
+ExprJit::~ExprJit()
+{
+    if (code)
+        releaseExecutable(code, code_size);
+}
+
+#else
+
+bool ExprJit::available()
+{
+    return false;
+}
+
+ExprJit::ExprJit(const ExprProgram& program, bool)
+    : code(nullptr), code_size(0), entry(nullptr), registers(program.registerCount()),
+    results(static_cast<int>(program.results().size()))
+{}
+
+ExprJit::~ExprJit()
+{}
+
+#endif
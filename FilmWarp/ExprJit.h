@@ -0,0 +1,137 @@
+#pragma once
+
+#include "ExprProgram.h"
+
+struct JitContext
+{
+    const void*  xs;
+    void*        regs;
+    void* const* outputs;
+    long long    n_bytes;
+    unsigned     y_bits;
+    unsigned     z_bits;
+};
+
+// Native x86-64 (SSE4.1) translation of an ExprProgram. The generated function
+// evaluates the program for one output row, 4 pixels per iteration, with the
+// same int/float semantics as ExprVM.
+class ExprJit
+{
+    typedef void(*Entry)(JitContext*);
+
+    void*  code;
+    size_t code_size;
+    Entry  entry;
+    int    registers;
+    int    results;
+
+public:
+    static bool available();
+
+    ExprJit(const ExprProgram& program, bool floating);
+    ExprJit(const ExprJit&) = delete;
+    ExprJit& operator=(const ExprJit&) = delete;
+    ~ExprJit();
+
+    bool compiled() const { return entry != nullptr; }
+    int registerCount() const { return registers; }
+    int resultCount() const { return results; }
+
+    void call(JitContext& ctx) const { entry(&ctx); }
+};
+
+template<class T> unsigned bitsOf(T v)
+{
+    unsigned bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+template<class T> class JitRunner
+{
+    const ExprJit*     jit;
+    std::vector<T>     xs;
+    std::vector<T>     regs;
+    std::vector<T>     tail;
+    std::vector<void*> row_out;
+
+public:
+    JitRunner() : jit(nullptr) {}
+
+    JitRunner(const ExprJit& jit_, int width) : jit(&jit_), xs((width + 3) & ~3), regs(std::max(jit_.registerCount(), 1) * 4),
+        tail(std::max(jit_.resultCount(), 1) * 4), row_out(jit_.resultCount())
+    {
+        for (size_t j = 0; j < xs.size(); j++)
+            xs[j] = static_cast<T>(j);
+    }
+
+    // Same contract as ExprVM::run; first and count must cover whole rows.
+    void run(int first, int count, int width, T z, T* const* outputs)
+    {
+        runFrom(first, count, width, z, outputs, 0);
+    }
+
+    // Same contract as ExprVM::runInto.
+    void runInto(int first, int count, int width, T z, T* const* outputs)
+    {
+        runFrom(first, count, width, z, outputs, first);
+    }
+
+private:
+    void runFrom(int first, int count, int width, T z, T* const* outputs, int base)
+    {
+        JitContext ctx;
+        ctx.regs = regs.data();
+        ctx.outputs = row_out.data();
+        ctx.z_bits = bitsOf(z);
+
+        const int body = width & ~3;
+        for (int row = first / width, row_end = (first + count) / width; row < row_end; row++)
+        {
+            ctx.y_bits = bitsOf(static_cast<T>(row));
+
+            if (body > 0)
+            {
+                for (size_t k = 0; k < row_out.size(); k++)
+                    row_out[k] = outputs[k] + (row * width - base);
+                ctx.xs = xs.data();
+                ctx.n_bytes = body * 4;
+                jit->call(ctx);
+            }
+
+            if (body < width)
+            {
+                for (size_t k = 0; k < row_out.size(); k++)
+                    row_out[k] = tail.data() + 4 * k;
+                ctx.xs = xs.data() + body;
+                ctx.n_bytes = 16;
+                jit->call(ctx);
+
+                for (size_t k = 0; k < row_out.size(); k++)
+                    std::copy_n(tail.data() + 4 * k, width - body, outputs[k] + (row * width - base) + body);
+            }
+        }
+    }
+};
+
+// Bit-exact comparison of the generated code against ExprVM on the first rows
+// of a frame; the warper only uses a JIT program that passes it.
+template<class T> bool verifyJit(const ExprJit& jit, const ExprProgram& program, int width, int height, T z)
+{
+    const int rows = std::min(height, 4);
+    const int count = rows * width;
+    const int results = static_cast<int>(program.results().size());
+
+    std::vector<T> expected(count * results), actual(count * results);
+    std::vector<T*> expected_out, actual_out;
+    for (int k = 0; k < results; k++)
+    {
+        expected_out.push_back(expected.data() + k * count);
+        actual_out.push_back(actual.data() + k * count);
+    }
+
+    ExprVM<T>(program).run(0, count, width, z, expected_out.data());
+    JitRunner<T>(jit, width).run(0, count, width, z, actual_out.data());
+
+    return memcmp(expected.data(), actual.data(), expected.size() * sizeof(T)) == 0;
+}
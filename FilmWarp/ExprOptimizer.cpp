@@ -0,0 +1,364 @@
+#include "stdafx.h"
+#include "ExprOptimizer.h"
+
+using namespace std;
+
+namespace
+{
+    typedef vector<unique_ptr<Expression3V>> Operands;
+
+    bool isConstant(const Expression3V& expr)
+    {
+        return expr.dependencies() == 0;
+    }
+
+    bool isLiteral(const Expression3V& expr)
+    {
+        return (expr.kind() == ExprKind::ConstI) || (expr.kind() == ExprKind::ConstF);
+    }
+
+    float literalValue(const Expression3V& expr)
+    {
+        if (expr.kind() == ExprKind::ConstI)
+            return static_cast<float>(static_cast<const EConstI&>(expr).get());
+        return static_cast<const EConstF&>(expr).get();
+    }
+
+    // Replaces a constant subtree by its value. A precise subtree may later be
+    // evaluated in either context, so it is only folded when both agree.
+    unique_ptr<Expression3V> fold(Expression3V& expr)
+    {
+        SmartSpan<int> nvec_i(1, 0);
+        SmartSpan<float> nvec_f(1, 0.f);
+
+        expr.setVars(&nvec_i, &nvec_i);
+        expr.setVars(&nvec_f, &nvec_f);
+        expr.setZ(0);
+        expr.setZ(0.f);
+
+        float f = expr.evaluateF().data[0];
+        if (!std::isfinite(f))
+            return nullptr;
+
+        if (!expr.isPrecise())
+            return make_unique<EConstF>(f);
+
+        int i = expr.evaluateI().data[0];
+        if (static_cast<float>(i) != f)
+            return nullptr;
+
+        return make_unique<EConstI>(i);
+    }
+
+    unique_ptr<Expression3V> simplifyAssociative(unique_ptr<Expression3V> pExpr, bool precise)
+    {
+        const ExprKind kind = pExpr->kind();
+        const bool sum = (kind == ExprKind::Sum);
+
+        // Regrouping is exact for integer values; otherwise only a leading
+        // operand may be flattened, since that keeps the evaluation order.
+        Operands operands;
+        for (auto& pChild : pExpr->releaseChildren())
+        {
+            if ((pChild->kind() == kind) && (operands.empty() || precise))
+            {
+                for (auto& pGrandChild : pChild->releaseChildren())
+                    operands.push_back(move(pGrandChild));
+            }
+            else
+            {
+                operands.push_back(move(pChild));
+            }
+        }
+
+        if (precise)
+        {
+            int acc = sum ? 0 : 1;
+            Operands rest;
+            for (auto& pOp : operands)
+            {
+                if (pOp->kind() == ExprKind::ConstI)
+                {
+                    int v = static_cast<const EConstI&>(*pOp).get();
+                    acc = sum ? (acc + v) : (acc * v);
+                }
+                else
+                {
+                    rest.push_back(move(pOp));
+                }
+            }
+
+            if (!sum && (acc == 0))
+                return make_unique<EConstI>(0);
+
+            operands = move(rest);
+
+            if (!sum && (acc != 1) && !operands.empty())
+            {
+                unique_ptr<Expression3V> pScale = make_unique<EScaleI>(acc);
+                if (operands.size() == 1)
+                {
+                    pScale->addChild(move(operands[0]));
+                }
+                else
+                {
+                    for (auto& pOp : operands)
+                        pExpr->addChild(move(pOp));
+                    pScale->addChild(move(pExpr));
+                }
+                return pScale;
+            }
+
+            if (acc != (sum ? 0 : 1))
+                operands.push_back(make_unique<EConstI>(acc));
+        }
+        else
+        {
+            size_t lead = 0;
+            while ((lead < operands.size()) && isConstant(*operands[lead]))
+                lead++;
+
+            if (lead > 1)
+            {
+                unique_ptr<Expression3V> pLead = sum ? unique_ptr<Expression3V>(make_unique<ESum>()) : unique_ptr<Expression3V>(make_unique<EMult>());
+                for (size_t k = 0; k < lead; k++)
+                    pLead->addChild(move(operands[k]));
+
+                auto pFolded = fold(*pLead);
+                operands.erase(operands.begin() + 1, operands.begin() + lead);
+                operands[0] = pFolded ? move(pFolded) : move(pLead);
+            }
+
+            const float identity = sum ? 0.f : 1.f;
+            for (size_t k = 0; k < operands.size();)
+            {
+                bool removable = isLiteral(*operands[k]) && (literalValue(*operands[k]) == identity) &&
+                    ((operands[k]->kind() == ExprKind::ConstI) || std::any_of(operands.begin(), operands.end(),
+                        [&](auto& pOp) { return (pOp != operands[k]) && !pOp->isPrecise(); }));
+
+                if (removable)
+                    operands.erase(operands.begin() + k);
+                else
+                    k++;
+            }
+
+            if (!sum && (operands.size() == 2) && (isLiteral(*operands[0]) || isLiteral(*operands[1])))
+            {
+                size_t c = isLiteral(*operands[1]) ? 1 : 0;
+                unique_ptr<Expression3V> pScale;
+                if (operands[c]->kind() == ExprKind::ConstI)
+                    pScale = make_unique<EScaleI>(static_cast<const EConstI&>(*operands[c]).get());
+                else
+                    pScale = make_unique<EScaleF>(static_cast<const EConstF&>(*operands[c]).get());
+                pScale->addChild(move(operands[1 - c]));
+                return pScale;
+            }
+        }
+
+        if (operands.empty())
+            return make_unique<EConstI>(sum ? 0 : 1);
+
+        if ((operands.size() == 1) && (operands[0]->isPrecise() == precise))
+            return move(operands[0]);
+
+        for (auto& pOp : operands)
+            pExpr->addChild(move(pOp));
+        return pExpr;
+    }
+
+    unique_ptr<Expression3V> simplifyScaleI(unique_ptr<Expression3V> pExpr, bool precise)
+    {
+        int coef = static_cast<const EScaleI&>(*pExpr).coefficient();
+        auto pChild = pExpr->popChild();
+
+        if ((pChild->kind() == ExprKind::ScaleI) && precise)
+        {
+            coef *= static_cast<const EScaleI&>(*pChild).coefficient();
+            pChild = pChild->popChild();
+        }
+
+        if (coef == 1)
+            return pChild;
+
+        if ((coef == 0) && precise)
+            return make_unique<EConstI>(0);
+
+        pExpr = make_unique<EScaleI>(coef);
+        pExpr->addChild(move(pChild));
+        return pExpr;
+    }
+
+    unique_ptr<Expression3V> simplifyScaleF(unique_ptr<Expression3V> pExpr)
+    {
+        if ((static_cast<const EScaleF&>(*pExpr).coefficient() == 1.f) && !pExpr->children()[0]->isPrecise())
+            return pExpr->popChild();
+        return pExpr;
+    }
+
+    unique_ptr<Expression3V> simplifyDiv(unique_ptr<Expression3V> pExpr)
+    {
+        const Expression3V& divisor = *pExpr->children()[1];
+        if (!isLiteral(divisor) || (literalValue(divisor) == 0.f))
+            return pExpr;
+
+        auto pScale = make_unique<EScaleF>(1.f / literalValue(divisor));
+        auto operands = pExpr->releaseChildren();
+        pScale->addChild(move(operands[0]));
+        return simplifyScaleF(move(pScale));
+    }
+
+    unique_ptr<Expression3V> simplifyClamp(unique_ptr<Expression3V> pExpr)
+    {
+        auto& outer = static_cast<const EClampI&>(*pExpr);
+        if (pExpr->children()[0]->kind() != ExprKind::ClampI)
+            return pExpr;
+
+        auto& inner = static_cast<const EClampI&>(*pExpr->children()[0]);
+        int low = std::max(outer.lowBound(), inner.lowBound());
+        int high = std::min(outer.highBound(), inner.highBound());
+        if (low > high)
+            return pExpr;
+
+        auto pInner = pExpr->popChild();
+        auto pMerged = make_unique<EClampI>(low, high);
+        pMerged->addChild(pInner->popChild());
+        return pMerged;
+    }
+}
+
+std::unique_ptr<Expression3V> simplify(std::unique_ptr<Expression3V> pExpr)
+{
+    const bool precise = pExpr->isPrecise();
+
+    for (auto& pChild : pExpr->releaseChildren())
+        pExpr->addChild(simplify(move(pChild)));
+
+    if (isConstant(*pExpr) && !isLiteral(*pExpr))
+    {
+        auto pFolded = fold(*pExpr);
+        if (pFolded)
+            return pFolded;
+    }
+
+    switch (pExpr->kind())
+    {
+    case ExprKind::Sum:
+    case ExprKind::Mult:   return simplifyAssociative(move(pExpr), precise);
+    case ExprKind::ScaleI: return simplifyScaleI(move(pExpr), precise);
+    case ExprKind::ScaleF: return simplifyScaleF(move(pExpr));
+    case ExprKind::Div:    return simplifyDiv(move(pExpr));
+    case ExprKind::ClampI: return simplifyClamp(move(pExpr));
+    default:               return pExpr;
+    }
+}
+
+namespace
+{
+    typedef unordered_map<const Expression3V*, string> Signatures;
+
+    const string& signature(const Expression3V& expr, Signatures& sigs)
+    {
+        ostringstream sig;
+        sig << static_cast<int>(expr.kind()) << hexfloat;
+
+        switch (expr.kind())
+        {
+        case ExprKind::ScaleI: sig << ':' << static_cast<const EScaleI&>(expr).coefficient(); break;
+        case ExprKind::ScaleF: sig << ':' << static_cast<const EScaleF&>(expr).coefficient(); break;
+        case ExprKind::ConstI: sig << ':' << static_cast<const EConstI&>(expr).get(); break;
+        case ExprKind::ConstF: sig << ':' << static_cast<const EConstF&>(expr).get(); break;
+        case ExprKind::ClampI:
+        {
+            auto& clamp_expr = static_cast<const EClampI&>(expr);
+            sig << ':' << clamp_expr.lowBound() << ':' << clamp_expr.highBound();
+            break;
+        }
+        default: break;
+        }
+
+        vector<string> operands;
+        for (auto& pChild : expr.children())
+            operands.push_back(signature(*pChild, sigs));
+
+        // a*b == b*a exactly, and any order is exact for integer values
+        bool commutative = (expr.kind() == ExprKind::Sum) || (expr.kind() == ExprKind::Mult);
+        if (commutative && (expr.isPrecise() || (operands.size() == 2)))
+            sort(operands.begin(), operands.end());
+
+        sig << '(';
+        for (auto& op : operands)
+            sig << op << ',';
+        sig << ')';
+
+        return sigs[&expr] = sig.str();
+    }
+
+    // Leaves are as cheap to evaluate as a cache hit, so only inner nodes are
+    // counted; the inside of a repeated subtree is only counted once.
+    void countUses(const Expression3V& expr, const Signatures& sigs, unordered_map<string, int>& uses)
+    {
+        if (expr.children().empty())
+            return;
+
+        if (++uses[sigs.at(&expr)] == 1)
+        {
+            for (auto& pChild : expr.children())
+                countUses(*pChild, sigs, uses);
+        }
+    }
+
+    void replaceShared(unique_ptr<Expression3V>& pExpr, const Signatures& sigs, unordered_map<string, int>& uses,
+        unordered_map<string, shared_ptr<SharedSlot>>& targets)
+    {
+        if (pExpr->children().empty())
+            return;
+
+        const string& sig = sigs.at(pExpr.get());
+        auto it = targets.find(sig);
+        if (it == targets.end())
+        {
+            for (auto& pChild : pExpr->releaseChildren())
+            {
+                replaceShared(pChild, sigs, uses, targets);
+                pExpr->addChild(move(pChild));
+            }
+
+            if (uses[sig] < 2)
+                return;
+
+            auto pSlot = make_shared<SharedSlot>();
+            pSlot->target = move(pExpr);
+            it = targets.emplace(sig, move(pSlot)).first;
+        }
+
+        pExpr = make_unique<EShared>(it->second);
+    }
+}
+
+void shareSubexpressions(array<unique_ptr<Expression3V>, 3>& exprs)
+{
+    Signatures sigs;
+    unordered_map<string, int> uses;
+    unordered_map<string, shared_ptr<SharedSlot>> targets;
+
+    for (auto& pExpr : exprs)
+        signature(*pExpr, sigs);
+
+    for (auto& pExpr : exprs)
+        countUses(*pExpr, sigs, uses);
+
+    for (auto& pExpr : exprs)
+        replaceShared(pExpr, sigs, uses, targets);
+}
+
+void prepareTriplet(array<unique_ptr<Expression3V>, 3>& exprs, int width, int height, int frames)
+{
+    int limits[3] = { width - 1, height - 1, frames - 1 };
+    for (int c = 0; c < 3; c++)
+    {
+        auto clamped = make_unique<EClampI>(0, limits[c]);
+        clamped->addChild(move(exprs[c]));
+        exprs[c] = simplify(move(clamped));
+    }
+    shareSubexpressions(exprs);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Expression3V.h"
+
+// Rewrites a parsed tree into an equivalent one with fewer nodes: constant
+// subtrees are folded, nested sums/products flattened, identities removed and
+// division by a constant turned into EScaleF. Every rewritten subtree keeps its
+// isPrecise(), so the root is still evaluated in the same (int or float) context.
+std::unique_ptr<Expression3V> simplify(std::unique_ptr<Expression3V> pExpr);
+
+// Hash-conses structurally identical subtrees of the three coordinate trees
+// into EShared nodes, so each is evaluated once per frame.
+void shareSubexpressions(std::array<std::unique_ptr<Expression3V>, 3>& exprs);
+
+// Prepares a parsed triplet for rendering from a width x height source of
+// the given number of frames: each coordinate is clamped to the source, then
+// simplified, and subtrees common to the three are shared.
+void prepareTriplet(std::array<std::unique_ptr<Expression3V>, 3>& exprs, int width, int height, int frames);
@@ -0,0 +1,173 @@
+#include "stdafx.h"
+#include "ExprProgram.h"
+
+using namespace std;
+
+namespace
+{
+    Instruction makeInstruction(OpCode op, int a = -1, int b = -1)
+    {
+        Instruction ins;
+        ins.op = op;
+        ins.dst = -1;
+        ins.a = a;
+        ins.b = b;
+        ins.ival[0] = ins.ival[1] = 0;
+        ins.fval[0] = ins.fval[1] = 0.f;
+        return ins;
+    }
+}
+
+const int ExprProgram::block_size;
+
+ExprProgram::ExprProgram() : registers(0) {}
+
+ExprProgram::ExprProgram(const std::vector<const Expression3V*>& roots) : registers(0)
+{
+    for (auto pRoot : roots)
+        outputs.push_back(lower(*pRoot));
+    shared_values.clear();
+    allocateRegisters();
+}
+
+int ExprProgram::emit(Instruction ins)
+{
+    ins.dst = static_cast<int>(code.size());
+    code.push_back(ins);
+    return ins.dst;
+}
+
+int ExprProgram::lower(const Expression3V& expr)
+{
+    auto& children = expr.children();
+
+    switch (expr.kind())
+    {
+    case ExprKind::VarX: return emit(makeInstruction(OpCode::LoadX));
+    case ExprKind::VarY: return emit(makeInstruction(OpCode::LoadY));
+    case ExprKind::VarZ: return emit(makeInstruction(OpCode::LoadZ));
+
+    case ExprKind::ConstI:
+    {
+        Instruction ins = makeInstruction(OpCode::Const);
+        ins.ival[0] = static_cast<const EConstI&>(expr).get();
+        ins.fval[0] = static_cast<float>(ins.ival[0]);
+        return emit(ins);
+    }
+
+    case ExprKind::ConstF:
+    {
+        Instruction ins = makeInstruction(OpCode::Const);
+        ins.fval[0] = static_cast<const EConstF&>(expr).get();
+        return emit(ins);
+    }
+
+    case ExprKind::Sum:
+    case ExprKind::Mult:
+    {
+        OpCode op = (expr.kind() == ExprKind::Sum) ? OpCode::Add : OpCode::Mul;
+        int acc = lower(*children[0]);
+        for (size_t c = 1; c < children.size(); c++)
+            acc = emit(makeInstruction(op, acc, lower(*children[c])));
+        return acc;
+    }
+
+    case ExprKind::Div:
+    case ExprKind::Mod:
+    case ExprKind::Floor:
+    {
+        OpCode op = (expr.kind() == ExprKind::Div) ? OpCode::Div : ((expr.kind() == ExprKind::Mod) ? OpCode::Mod : OpCode::Floor);
+        int a = lower(*children[0]);
+        int b = lower(*children[1]);
+        return emit(makeInstruction(op, a, b));
+    }
+
+    case ExprKind::ScaleI:
+    {
+        Instruction ins = makeInstruction(OpCode::Scale, lower(*children[0]));
+        ins.ival[0] = static_cast<const EScaleI&>(expr).coefficient();
+        ins.fval[0] = static_cast<float>(ins.ival[0]);
+        return emit(ins);
+    }
+
+    case ExprKind::ScaleF:
+    {
+        Instruction ins = makeInstruction(OpCode::Scale, lower(*children[0]));
+        ins.fval[0] = static_cast<const EScaleF&>(expr).coefficient();
+        return emit(ins);
+    }
+
+    case ExprKind::ClampI:
+    {
+        auto& clamp_expr = static_cast<const EClampI&>(expr);
+        Instruction ins = makeInstruction(OpCode::Clamp, lower(*children[0]));
+        ins.ival[0] = clamp_expr.lowBound();
+        ins.ival[1] = clamp_expr.highBound();
+        ins.fval[0] = static_cast<float>(ins.ival[0]);
+        ins.fval[1] = static_cast<float>(ins.ival[1]);
+        return emit(ins);
+    }
+
+    case ExprKind::Shared:
+    {
+        const Expression3V* pTarget = &static_cast<const EShared&>(expr).target();
+        auto it = shared_values.find(pTarget);
+        if (it != shared_values.end())
+            return it->second;
+        int r = lower(*pTarget);
+        shared_values[pTarget] = r;
+        return r;
+    }
+
+    default:
+        return emit(makeInstruction(OpCode::Const));
+    }
+}
+
+void ExprProgram::allocateRegisters()
+{
+    const int never = static_cast<int>(code.size());
+
+    vector<int> last_use(code.size(), -1);
+    for (int i = 0; i < never; i++)
+    {
+        if (code[i].a >= 0) last_use[code[i].a] = i;
+        if (code[i].b >= 0) last_use[code[i].b] = i;
+    }
+    for (int r : outputs)
+        last_use[r] = never;
+
+    vector<int> physical(code.size(), -1);
+    vector<int> free_list;
+
+    for (int i = 0; i < never; i++)
+    {
+        Instruction& ins = code[i];
+        int a = ins.a;
+        int b = ins.b;
+
+        if (a >= 0)
+            ins.a = physical[a];
+        if (b >= 0)
+            ins.b = physical[b];
+
+        if ((a >= 0) && (last_use[a] == i))
+            free_list.push_back(physical[a]);
+        if ((b >= 0) && (b != a) && (last_use[b] == i))
+            free_list.push_back(physical[b]);
+
+        if (free_list.empty())
+        {
+            physical[i] = registers++;
+        }
+        else
+        {
+            physical[i] = free_list.back();
+            free_list.pop_back();
+        }
+        ins.dst = physical[i];
+    }
+
+    for (int& r : outputs)
+        r = physical[r];
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Expression3V.h"
+
+enum class OpCode : unsigned char
+{
+    LoadX,
+    LoadY,
+    LoadZ,
+    Const,
+    Add,
+    Mul,
+    Div,
+    Mod,
+    Floor,
+    Scale,
+    Clamp
+};
+
+struct Instruction
+{
+    OpCode op;
+    int    dst;
+    int    a;
+    int    b;
+    int    ival[2];
+    float  fval[2];
+};
+
+// Linear form of one or more Expression3V trees: every node becomes one
+// instruction over a register of block_size values, registers are reused
+// once their value is dead, and root k ends up in register outputs[k].
+class ExprProgram
+{
+    std::vector<Instruction> code;
+    std::vector<int>         outputs;
+    int                      registers;
+    std::unordered_map<const Expression3V*, int> shared_values;
+
+    int emit(Instruction ins);
+    int lower(const Expression3V& expr);
+    void allocateRegisters();
+public:
+    static const int block_size = 256;
+
+    ExprProgram();
+    ExprProgram(const std::vector<const Expression3V*>& roots);
+
+    const std::vector<Instruction>& instructions() const { return code; }
+    const std::vector<int>& results() const { return outputs; }
+    int registerCount() const { return registers; }
+    bool empty() const { return outputs.empty(); }
+};
+
+template<class T> inline T immediate(const Instruction& ins, int k);
+template<> inline int immediate<int>(const Instruction& ins, int k) { return ins.ival[k]; }
+template<> inline float immediate<float>(const Instruction& ins, int k) { return ins.fval[k]; }
+
+template<class T> class ExprVM
+{
+    const ExprProgram* program;
+    std::vector<T>     file;
+
+    T* reg(int r) { return file.data() + r * ExprProgram::block_size; }
+
+    void runBlock(int first, int count, int width, T z, T* const* outputs, int base)
+    {
+        for (const Instruction& ins : program->instructions())
+        {
+            T* d = reg(ins.dst);
+            const T* a = (ins.a >= 0) ? reg(ins.a) : nullptr;
+            const T* b = (ins.b >= 0) ? reg(ins.b) : nullptr;
+            T c0 = immediate<T>(ins, 0);
+            T c1 = immediate<T>(ins, 1);
+
+            switch (ins.op)
+            {
+            case OpCode::LoadX:
+            {
+                int col = first % width;
+                for (int k = 0; k < count; k++)
+                {
+                    d[k] = static_cast<T>(col);
+                    if (++col == width)
+                        col = 0;
+                }
+                break;
+            }
+            case OpCode::LoadY:
+            {
+                int col = first % width;
+                int row = first / width;
+                for (int k = 0; k < count; k++)
+                {
+                    d[k] = static_cast<T>(row);
+                    if (++col == width)
+                    {
+                        col = 0;
+                        row++;
+                    }
+                }
+                break;
+            }
+            case OpCode::LoadZ: for (int k = 0; k < count; k++) d[k] = z; break;
+            case OpCode::Const: for (int k = 0; k < count; k++) d[k] = c0; break;
+            case OpCode::Add:   for (int k = 0; k < count; k++) d[k] = a[k] + b[k]; break;
+            case OpCode::Mul:   for (int k = 0; k < count; k++) d[k] = a[k] * b[k]; break;
+            case OpCode::Div:   for (int k = 0; k < count; k++) d[k] = std::is_integral<T>::value ? T(0) : a[k] / b[k]; break;
+            case OpCode::Mod:   for (int k = 0; k < count; k++) d[k] = mod(a[k], b[k]); break;
+            case OpCode::Floor: for (int k = 0; k < count; k++) d[k] = floor_op(a[k], b[k]); break;
+            case OpCode::Scale: for (int k = 0; k < count; k++) d[k] = a[k] * c0; break;
+            case OpCode::Clamp: for (int k = 0; k < count; k++) d[k] = clamp<T>(a[k], c0, c1); break;
+            }
+        }
+
+        for (size_t r = 0; r < program->results().size(); r++)
+            std::copy_n(reg(program->results()[r]), count, outputs[r] + (first - base));
+    }
+public:
+    ExprVM() : program(nullptr) {}
+
+    ExprVM(const ExprProgram& program_) : program(&program_),
+        file(static_cast<size_t>(program_.registerCount()) * ExprProgram::block_size)
+    {}
+
+    // Evaluates pixels [first, first + count) of a frame of the given width;
+    // result k is written to outputs[k][first ...].
+    void run(int first, int count, int width, T z, T* const* outputs)
+    {
+        runFrom(first, count, width, z, outputs, 0);
+    }
+
+    // Same as run, but pixel first + j of result k goes to outputs[k][j], so a
+    // few rows can be evaluated into small buffers right before they are used.
+    void runInto(int first, int count, int width, T z, T* const* outputs)
+    {
+        runFrom(first, count, width, z, outputs, first);
+    }
+
+private:
+    void runFrom(int first, int count, int width, T z, T* const* outputs, int base)
+    {
+        for (int end = first + count; first < end; first += ExprProgram::block_size)
+            runBlock(first, std::min(ExprProgram::block_size, end - first), width, z, outputs, base);
+    }
+};
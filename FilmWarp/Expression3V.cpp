@@ -1,4 +1,3 @@
-#pragma once
 #include "stdafx.h"
 #include "Expression3V.h"
 
@@ -10,8 +9,8 @@ Interval operator+(Interval i1, Interval i2)
 Interval operator*(Interval i1, Interval i2)
 {
     Interval result;
-    result.a = std::min({ i1.a*i2.a, i1.a*i2.b, i1.b*i2.a });
-    result.b = std::max(i1.a*i2.a, i1.b*i2.b);
+    result.a = std::min({ i1.a*i2.a, i1.a*i2.b, i1.b*i2.a, i1.b*i2.b });
+    result.b = std::max({ i1.a*i2.a, i1.a*i2.b, i1.b*i2.a, i1.b*i2.b });
     return result;
 }
 
@@ -25,11 +24,12 @@ Interval operator*(float x, Interval i)
 
 Interval invert(Interval i)
 {
-    if ((i.a < 0) && (i.b > 0))
-        return Interval{ std::numeric_limits<float>::min(), std::numeric_limits<float>::max() };
+    const float inf = std::numeric_limits<float>::max();
+    if (((i.a < 0) && (i.b > 0)) || ((i.a == 0.f) && (i.b == 0.f)))
+        return Interval{ -inf, inf };
     Interval result;
-    result.a = ((i.b == 0.f) ? std::numeric_limits<float>::min() : (1.f / i.b));
-    result.b = ((i.a == 0.f) ? std::numeric_limits<float>::max() : (1.f / i.a));
+    result.a = ((i.b == 0.f) ? -inf : (1.f / i.b));
+    result.b = ((i.a == 0.f) ? inf : (1.f / i.a));
     return result;
 }
 
@@ -65,6 +65,11 @@ std::unique_ptr<Expression3V> Expression3V::popChild()
     return r;
 }
 
+std::vector<std::unique_ptr<Expression3V>> Expression3V::releaseChildren()
+{
+    return std::move(pChildren);
+}
+
 void Expression3V::setVars(SmartSpan<float>* xf_, SmartSpan<float>* yf_)
 {
     xf = xf_; yf = yf_;
@@ -100,36 +105,52 @@ float Expression3V::priority() const
     return 0.f;
 }
 
+ExprKind Expression3V::kind() const { return ExprKind::None; }
+
+int Expression3V::dependencies() const
+{
+    return std::accumulate(pChildren.begin(), pChildren.end(), 0, [](int mask, auto& pChild)
+    {
+        return mask | pChild->dependencies();
+    });
+}
+
 SmartSpan<float> Expression3V::evaluateF() { return SmartSpan<float>(width); }
 SmartSpan<int> Expression3V::evaluateI() { return SmartSpan<int>(width); }
 
 
 bool EVarX::isPrecise() const { return true; }
+ExprKind EVarX::kind() const { return ExprKind::VarX; }
+int EVarX::dependencies() const { return VarX; }
 
 SmartSpan<float> EVarX::evaluateF() { return *xf; }
 SmartSpan<int> EVarX::evaluateI() { return *xi; }
 
-Interval EVarX::getImage(Interval & x, Interval & y, Interval & z)
+Interval EVarX::getImage(Interval & x, Interval &, Interval &)
 {
     return x;
 }
 
 bool EVarY::isPrecise() const { return true; }
+ExprKind EVarY::kind() const { return ExprKind::VarY; }
+int EVarY::dependencies() const { return VarY; }
 
 SmartSpan<float> EVarY::evaluateF() { return *yf; }
 SmartSpan<int> EVarY::evaluateI() { return *yi; }
 
-Interval EVarY::getImage(Interval & x, Interval & y, Interval & z)
+Interval EVarY::getImage(Interval &, Interval & y, Interval &)
 {
     return y;
 }
 
 bool EVarZ::isPrecise() const { return true; }
+ExprKind EVarZ::kind() const { return ExprKind::VarZ; }
+int EVarZ::dependencies() const { return VarZ; }
 
 SmartSpan<float> EVarZ::evaluateF() { return SmartSpan<float>(width, zf); }
 SmartSpan<int> EVarZ::evaluateI() { return SmartSpan<int>(width, zi); }
 
-Interval EVarZ::getImage(Interval & x, Interval & y, Interval & z)
+Interval EVarZ::getImage(Interval &, Interval &, Interval & z)
 {
     return z;
 }
@@ -139,12 +160,17 @@ bool ESum::isPrecise() const
     return std::all_of(pChildren.begin(), pChildren.end(), [](auto& ptr) { return ptr->isPrecise(); });
 }
 
+ExprKind ESum::kind() const
+{
+    return ExprKind::Sum;
+}
+
 SmartSpan<float> ESum::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
     for (auto it = pChildren.begin() + 1; it != pChildren.end(); ++it)
     {
-        vec = vec + (*it)->evaluateF();
+        vec += (*it)->evaluateF();
     }
     return vec;
 }
@@ -154,7 +180,7 @@ SmartSpan<int> ESum::evaluateI()
     auto vec = pChildren[0]->evaluateI();
     for (auto it = pChildren.begin() + 1; it != pChildren.end(); ++it)
     {
-        vec = vec + (*it)->evaluateI();
+        vec += (*it)->evaluateI();
     }
     return vec;
 }
@@ -179,17 +205,22 @@ bool EScaleI::isPrecise() const
     return pChildren[0]->isPrecise();
 }
 
+ExprKind EScaleI::kind() const
+{
+    return ExprKind::ScaleI;
+}
+
 SmartSpan<float> EScaleI::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
-    vec = vec * SmartSpan<float>(width, coef_f);
+    vec *= SmartSpan<float>(width, coef_f);
     return vec;
 }
 
 SmartSpan<int> EScaleI::evaluateI()
 {
     auto vec = pChildren[0]->evaluateI();
-    vec = vec * SmartSpan<int>(width, coef);
+    vec *= SmartSpan<int>(width, coef);
     return vec;
 }
 
@@ -205,10 +236,15 @@ bool EScaleF::isPrecise() const
     return false;
 }
 
+ExprKind EScaleF::kind() const
+{
+    return ExprKind::ScaleF;
+}
+
 SmartSpan<float> EScaleF::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
-    vec = vec * SmartSpan<float>(width, coef);
+    vec *= SmartSpan<float>(width, coef);
     return vec;
 }
 
@@ -224,6 +260,11 @@ bool EConstI::isPrecise() const
     return true;
 }
 
+ExprKind EConstI::kind() const
+{
+    return ExprKind::ConstI;
+}
+
 SmartSpan<float> EConstI::evaluateF()
 {
     return SmartSpan<float>(width, value_f);
@@ -234,7 +275,7 @@ SmartSpan<int> EConstI::evaluateI()
     return SmartSpan<int>(width, value);
 }
 
-    Interval EConstI::getImage(Interval & x, Interval & y, Interval & z)
+    Interval EConstI::getImage(Interval &, Interval &, Interval &)
     {
         return Interval{ value_f, value_f };
     }
@@ -247,6 +288,11 @@ bool EConstF::isPrecise() const
     return false;
 }
 
+ExprKind EConstF::kind() const
+{
+    return ExprKind::ConstF;
+}
+
 SmartSpan<float> EConstF::evaluateF()
 {
     return SmartSpan<float>(width, value);
@@ -257,7 +303,7 @@ SmartSpan<int> EConstF::evaluateI()
     return SmartSpan<int>(width, 0);
 }
 
-Interval EConstF::getImage(Interval & x, Interval & y, Interval & z)
+Interval EConstF::getImage(Interval &, Interval &, Interval &)
 {
     return Interval{ value, value };
 }
@@ -271,109 +317,43 @@ bool EClampI::isPrecise() const
     return pChildren[0]->isPrecise();;
 }
 
-template<class T> void sparselinear_clamp(SmartSpan<T>& vec, T low, T high)
+ExprKind EClampI::kind() const
 {
-    SmartSpan<T> result;
-    result.type = SpanType::SparseLinear;
-    result.size = vec.size;
-    result.offsets.push_back(0);
-    for (int i = 0; i < vec.offsets.size() - 1; i++)
-    {
-        T v = vec.data[2 * i];
-        T vs = v;
-        T step = vec.data[2 * i + 1];
-        int j = vec.offsets[i];
-
-        if (v < low)
-        {
-            for (; j < vec.offsets[i + 1]; j++, v += step)
-            {
-                if (v > low)
-                {
-                    result.data.push_back(low);
-                    result.data.push_back(0);
-                    result.offsets.push_back(j);
-                    goto loop_mid;
-                }
-            }
-
-            result.data.push_back(low);
-            result.data.push_back(0);
-            result.offsets.push_back(j);
-            goto loop_exit;
-        }
-
-        if (v > high)
-        {
-            for (; j < vec.offsets[i + 1]; j++, v += step)
-            {
-                if (v < high)
-                {
-                    result.data.push_back(high);
-                    result.data.push_back(0);
-                    result.offsets.push_back(j);
-                    goto loop_mid;
-                }
-            }
-
-            result.data.push_back(high);
-            result.data.push_back(0);
-            result.offsets.push_back(j);
-            goto loop_exit;
-        }
-
-    loop_mid:
-        vs = v;
-        int js = j;
-
-        for (; j < vec.offsets[i + 1]; j++, v += step)
-        {
-            if ((v > high) || (v < low))
-            {
-                if (j > js)
-                {
-                    result.data.push_back(vs);
-                    result.data.push_back(step);
-                    result.offsets.push_back(j);
-                }
-                goto loop_last;
-            }
-        }
+    return ExprKind::ClampI;
+}
 
-        result.data.push_back(vs);
-        result.data.push_back(step);
-        result.offsets.push_back(j);
+// A clamp leaves an affine span untouched when the whole frame is inside the
+// bounds. The corners bound the exact values; for floats the rounding of the
+// row stepping must also stay well below a pixel.
+template<class T> bool affine_within(const SmartSpan<T>& vec, T low, T high)
+{
+    double a = vec.data[0], b = vec.data[1], c = vec.data[2];
+    double last_col = vec.width - 1;
+    double last_row = vec.size / vec.width - 1;
+    double lo = a + std::min(0.0, b*last_col) + std::min(0.0, c*last_row);
+    double hi = a + std::max(0.0, b*last_col) + std::max(0.0, c*last_row);
 
-        goto loop_exit;
-    loop_last:
+    double magnitude = std::fabs(a) + std::fabs(b*last_col) + std::fabs(c*last_row);
+    if (magnitude > (1 << 24))
+        return false;
+    if (std::is_floating_point<T>::value && ((vec.width + 2) * magnitude * std::numeric_limits<float>::epsilon() > 0.5))
+        return false;
 
-        if (v > high)
-        {
-            result.data.push_back(high);
-            result.data.push_back(0);
-            result.offsets.push_back(j);
-        }
-        else
-        {
-            result.data.push_back(low);
-            result.data.push_back(0);
-            result.offsets.push_back(j);
-        }
-
-    loop_exit:;
-    }
-
-    vec = std::move(result);
+    return (lo >= low) && (hi <= high);
 }
 
 SmartSpan<float> EClampI::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
+    if ((vec.type == SpanType::Affine2D) && !affine_within(vec, low_f, high_f))
+        vec.to_rows();
+
     switch (vec.type)
     {
     case SpanType::Dense:
     case SpanType::Sparse: for (auto& val : vec.data) val = clamp<float>(val, low_f, high_f);  break;
-    case SpanType::SparseLinear: sparselinear_clamp<float>(vec, low_f, high_f);
+    case SpanType::SparseLinear: sparselinear_clamp<float>(vec, low_f, high_f); break;
+    case SpanType::Affine2D: break;
     }
     return vec;
 }
@@ -381,11 +361,15 @@ SmartSpan<float> EClampI::evaluateF()
 SmartSpan<int> EClampI::evaluateI()
 {
     auto vec = pChildren[0]->evaluateI();
+    if ((vec.type == SpanType::Affine2D) && !affine_within(vec, low, high))
+        vec.to_rows();
+
     switch(vec.type)
     {
     case SpanType::Dense:
     case SpanType::Sparse: for(auto& val : vec.data) val = clamp<int>(val, low, high);  break;
     case SpanType::SparseLinear:  sparselinear_clamp<int>(vec, low, high); break;
+    case SpanType::Affine2D: break;
     }
     return vec;
 }
@@ -401,12 +385,17 @@ bool EMult::isPrecise() const
     return std::all_of(pChildren.begin(), pChildren.end(), [](auto& ptr) { return ptr->isPrecise(); });
 }
 
+ExprKind EMult::kind() const
+{
+    return ExprKind::Mult;
+}
+
 SmartSpan<float> EMult::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
     for (auto it = pChildren.begin() + 1; it != pChildren.end(); ++it)
     {
-        vec = vec * (*it)->evaluateF();
+        vec *= (*it)->evaluateF();
     }
     return vec;
 }
@@ -416,7 +405,7 @@ SmartSpan<int> EMult::evaluateI()
     auto vec = pChildren[0]->evaluateI();
     for (auto it = pChildren.begin() + 1; it != pChildren.end(); ++it)
     {
-        vec = vec * (*it)->evaluateI();
+        vec *= (*it)->evaluateI();
     }
     return vec;
 }
@@ -434,26 +423,128 @@ bool EMod::isPrecise() const
     return std::all_of(pChildren.begin(), pChildren.end(), [](auto& ptr) { return ptr->isPrecise(); });
 }
 
-float mod(float x, float y)
+ExprKind EMod::kind() const
+{
+    return ExprKind::Mod;
+}
+
+inline float quotient(float x, float y)
 {
-    return x - floor(x / y)*y;
+    return std::floor(x / y);
 }
 
-int mod(int x, int y)
+inline int quotient(int x, int y)
 {
-    return x%y;
+    return x / y;
+}
+
+// Splits every linear segment of vec into the runs over which quotient(value, divisor)
+// stays constant and calls emit(start value, step, divisor, run end) for each. The quotient is
+// monotonic along a segment, so run ends are found by galloping and bisection.
+// Returns false (leaving vec untouched) once the runs get too short to pay off.
+template<class T, class F> bool linear_runs(const SmartSpan<T>& vec, const SmartSpan<T>& vop, F emit)
+{
+    const size_t max_runs = vec.size / 4 + vec.offsets.size() + vop.offsets.size();
+    size_t runs = 0;
+    int off1 = 1;
+    int off2 = 1;
+    int pos = 0;
+    while ((off1 < static_cast<int>(vec.offsets.size())) && (off2 < static_cast<int>(vop.offsets.size())))
+    {
+        const int first = vec.offsets[off1 - 1];
+        const T v0 = vec.data[2 * (off1 - 1)];
+        const T step = vec.data[2 * (off1 - 1) + 1];
+        const T d = vop.data[off2 - 1];
+        const int end = std::min(vec.offsets[off1], vop.offsets[off2]);
+
+        auto value = [&](int j) { return v0 + step * static_cast<T>(j - first); };
+
+        while (pos < end)
+        {
+            const T v = value(pos);
+            const T q = quotient(v, d);
+            auto same = [&](int n) { return quotient(value(pos + n), d) == q; };
+
+            int good = 0;
+            int bad = end - pos;
+            for (int n = 1; good + n < bad; n *= 2)
+            {
+                if (!same(good + n))
+                {
+                    bad = good + n;
+                    break;
+                }
+                good += n;
+            }
+            while (bad - good > 1)
+            {
+                int mid = good + (bad - good) / 2;
+                if (same(mid)) good = mid;
+                else bad = mid;
+            }
+
+            if (++runs > max_runs)
+                return false;
+
+            pos += bad;
+            emit(v, step, d, pos);
+        }
+
+        if (vec.offsets[off1] == end) off1++;
+        if (vop.offsets[off2] == end) off2++;
+    }
+    return true;
 }
 
 template<class T> void mod_spans(SmartSpan<T>& vec, const SmartSpan<T>& vop)
 {
-    // if ((vec.type == SpanType::SparseLinear) && (vop.type == SpanType::Sparse))
-    // {
-    //      // can be improved in to return SparseLinear span in this case      
-    // }
+    vec.to_rows();
+    if ((vec.type == SpanType::SparseLinear) && (vop.type == SpanType::Sparse))
+    {
+        // between wrap points x%d is x shifted by a multiple of d, so the steps carry over
+        size_t segments = vec.offsets.size() + vop.offsets.size();
+        SmartSpan<T> result(SpanType::SparseLinear, vec.size, 2 * segments, segments);
+        result.offsets.push_back(0);
+        bool split = linear_runs(vec, vop, [&](T v, T step, T d, int end)
+        {
+            result.data.push_back(mod(v, d));
+            result.data.push_back(step);
+            result.offsets.push_back(end);
+        });
+        if (split)
+        {
+            vec = std::move(result);
+            return;
+        }
+    }
 
     generic_op(vec, vop, [](auto x, auto y) { return mod(x, y); });
 }
 
+template<class T> void floor_spans(SmartSpan<T>& vec, const SmartSpan<T>& vop)
+{
+    vec.to_rows();
+    if ((vec.type == SpanType::SparseLinear) && (vop.type == SpanType::Sparse))
+    {
+        // the floored value only changes at step points, giving a piecewise constant span
+        size_t segments = vec.offsets.size() + vop.offsets.size();
+        SmartSpan<T> result(SpanType::Sparse, vec.size, segments, segments);
+        result.offsets.push_back(0);
+        bool split = linear_runs(vec, vop, [&](T v, T, T d, int end)
+        {
+            result.data.push_back(floor_op(v, d));
+            result.offsets.push_back(end);
+        });
+        if (split)
+        {
+            vec = std::move(result);
+            return;
+        }
+    }
+
+    generic_op(vec, vop, [](auto x, auto y) { return floor_op(x, y); });
+}
+
 SmartSpan<float> EMod::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
@@ -477,10 +568,19 @@ Interval EMod::getImage(Interval & x, Interval & y, Interval & z)
     Interval a = pChildren[0]->getImage(x, y, z);
     Interval b = pChildren[1]->getImage(x, y, z);
 
-    if (a.a > 0 && a.b <= b.a)
+    if (a.a >= 0 && a.b < b.a)
         return a;
 
-    return Interval{ 0.f, b.b};
+    // a non-negative range inside a single period of a fixed modulus is shifted as a whole
+    if ((a.a >= 0) && (b.a == b.b) && (b.a > 0))
+    {
+        float q = std::floor(a.a / b.a);
+        if (std::floor(a.b / b.a) == q)
+            return Interval{ a.a - q*b.a, a.b - q*b.a };
+    }
+
+    // int remainders of negative values are negative
+    return Interval{ (a.a < 0) ? -b.b : 0.f, b.b };
 }
 
 bool EDiv::isPrecise() const
@@ -488,6 +588,11 @@ bool EDiv::isPrecise() const
     return false;
 }
 
+ExprKind EDiv::kind() const
+{
+    return ExprKind::Div;
+}
+
 SmartSpan<float> EDiv::evaluateF()
 {
     auto vec = pChildren[0]->evaluateF();
@@ -502,6 +607,15 @@ Interval EDiv::getImage(Interval & x, Interval & y, Interval & z)
 {
     Interval a = pChildren[0]->getImage(x, y, z);
     Interval b = pChildren[1]->getImage(x, y, z);
+
+    // Dividing the bounds keeps the rounding of the evaluated quotients, which
+    // a * invert(b) can miss by an ulp (49 * (1/49) < 1); with a divisor of
+    // fixed sign the quotient is monotonic in both operands.
+    if ((b.a > 0) || (b.b < 0))
+    {
+        float q[4] = { a.a / b.a, a.a / b.b, a.b / b.a, a.b / b.b };
+        return Interval{ *std::min_element(q, q + 4), *std::max_element(q, q + 4) };
+    }
     return a * invert(b);
 }
 
@@ -510,14 +624,9 @@ bool EFloor::isPrecise() const
     return std::all_of(pChildren.begin(), pChildren.end(), [](auto& ptr) { return ptr->isPrecise(); });
 }
 
-float floor_op(float a, float b)
-{
-    return floor(a / b)*b;
-}
-
-int floor_op(int a, int b)
+ExprKind EFloor::kind() const
 {
-    return a - (a%b);
+    return ExprKind::Floor;
 }
 
 SmartSpan<float> EFloor::evaluateF()
@@ -525,7 +634,7 @@ SmartSpan<float> EFloor::evaluateF()
     auto vec = pChildren[0]->evaluateF();
     auto vop = pChildren[1]->evaluateF();
 
-    generic_op(vec, vop, [](auto &x, auto &y) { return floor_op(x, y); });
+    floor_spans<float>(vec, vop);
 
     return vec;
 }
@@ -535,7 +644,7 @@ SmartSpan<int> EFloor::evaluateI()
     auto vec = pChildren[0]->evaluateI();
     auto vop = pChildren[1]->evaluateI();
 
-    generic_op(vec, vop, [](auto &x, auto &y) { return floor_op(x, y); });
+    floor_spans<int>(vec, vop);
 
     return vec;
 }
@@ -545,5 +654,84 @@ Interval EFloor::getImage(Interval & x, Interval & y, Interval & z)
     Interval a = pChildren[0]->getImage(x, y, z);
     Interval b = pChildren[1]->getImage(x, y, z);
 
-    return a;
+    // rounding to a multiple of a fixed positive step is monotonic; int
+    // rounding truncates, so negative values may round up to at most 0
+    if ((b.a == b.b) && (b.a > 0))
+        return Interval{ std::floor(a.a / b.a)*b.a, (a.b >= 0) ? std::floor(a.b / b.a)*b.a : 0.f };
+
+    if (b.a > 0)
+        return Interval{ a.a - b.b, a.b + b.b };
+
+    return Interval{ -std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+}
+
+EShared::EShared(std::shared_ptr<SharedSlot> pSlot_) : pSlot(std::move(pSlot_)) {}
+
+bool EShared::isPrecise() const
+{
+    return pSlot->target->isPrecise();
+}
+
+ExprKind EShared::kind() const
+{
+    return ExprKind::Shared;
+}
+
+int EShared::dependencies() const
+{
+    return pSlot->target->dependencies();
+}
+
+void EShared::setVars(SmartSpan<float>* xf_, SmartSpan<float>* yf_)
+{
+    pSlot->valid_f = false;
+    pSlot->target->setVars(xf_, yf_);
+}
+
+void EShared::setVars(SmartSpan<int>* xi_, SmartSpan<int>* yi_)
+{
+    pSlot->valid_i = false;
+    pSlot->target->setVars(xi_, yi_);
+}
+
+// every reference passes the same z, so only the first one of a pass invalidates
+void EShared::setZ(float zf_)
+{
+    if ((zf_ != pSlot->zf) && (dependencies() & VarZ))
+        pSlot->valid_f = false;
+    pSlot->zf = zf_;
+    pSlot->target->setZ(zf_);
+}
+
+void EShared::setZ(int zi_)
+{
+    if ((zi_ != pSlot->zi) && (dependencies() & VarZ))
+        pSlot->valid_i = false;
+    pSlot->zi = zi_;
+    pSlot->target->setZ(zi_);
+}
+
+SmartSpan<float> EShared::evaluateF()
+{
+    if (!pSlot->valid_f)
+    {
+        pSlot->cache_f = pSlot->target->evaluateF();
+        pSlot->valid_f = true;
+    }
+    return pSlot->cache_f;
+}
+
+SmartSpan<int> EShared::evaluateI()
+{
+    if (!pSlot->valid_i)
+    {
+        pSlot->cache_i = pSlot->target->evaluateI();
+        pSlot->valid_i = true;
+    }
+    return pSlot->cache_i;
+}
+
+Interval EShared::getImage(Interval & x, Interval & y, Interval & z)
+{
+    return pSlot->target->getImage(x, y, z);
 }
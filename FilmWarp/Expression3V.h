@@ -15,6 +15,52 @@ Interval invert(Interval i);
 std::vector<Interval> diff(Interval i1, Interval i2);
 float length(Interval i);
 
+enum VarMask
+{
+    VarX = 1,
+    VarY = 2,
+    VarZ = 4
+};
+
+enum class ExprKind
+{
+    None,
+    VarX,
+    VarY,
+    VarZ,
+    Sum,
+    Mult,
+    Div,
+    Mod,
+    Floor,
+    ScaleI,
+    ScaleF,
+    ConstI,
+    ConstF,
+    ClampI,
+    Shared
+};
+
+inline float mod(float x, float y)
+{
+    return x - std::floor(x / y)*y;
+}
+
+inline int mod(int x, int y)
+{
+    return x%y;
+}
+
+inline float floor_op(float a, float b)
+{
+    return std::floor(a / b)*b;
+}
+
+inline int floor_op(int a, int b)
+{
+    return a - (a%b);
+}
+
 class Expression3V
 {
 protected:
@@ -32,19 +78,24 @@ public:
     Expression3V();
     virtual bool isPrecise() const;
     virtual float priority() const;
+    virtual int dependencies() const;
+    virtual ExprKind kind() const;
+
+    const std::vector<std::unique_ptr<Expression3V>>& children() const { return pChildren; }
 
     void addChild(std::unique_ptr<Expression3V> pC);
     std::unique_ptr<Expression3V> popChild();
+    std::vector<std::unique_ptr<Expression3V>> releaseChildren();
 
-    void setVars(SmartSpan<float>* xf_, SmartSpan<float>* yf_);
-    void setVars(SmartSpan<int>* xi_, SmartSpan<int>* yi_);
-    void setZ(float zf_);
-    void setZ(int zi_);
+    virtual void setVars(SmartSpan<float>* xf_, SmartSpan<float>* yf_);
+    virtual void setVars(SmartSpan<int>* xi_, SmartSpan<int>* yi_);
+    virtual void setZ(float zf_);
+    virtual void setZ(int zi_);
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
 
-    virtual Interval getImage(Interval& x, Interval& y, Interval& z) { return Interval{ 0,0 }; }
+    virtual Interval getImage(Interval&, Interval&, Interval&) { return Interval{ 0,0 }; }
 
     virtual ~Expression3V() {}
 };
@@ -53,6 +104,8 @@ class EVarX : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
+    virtual int dependencies() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -64,6 +117,8 @@ class EVarY : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
+    virtual int dependencies() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -75,6 +130,8 @@ class EVarZ : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
+    virtual int dependencies() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -86,6 +143,7 @@ class ESum : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -99,6 +157,7 @@ class EMult : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -110,6 +169,7 @@ class EDiv : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
 
@@ -120,6 +180,7 @@ class EMod : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -131,6 +192,7 @@ class EFloor : public Expression3V
 {
 public:
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -144,7 +206,9 @@ class EScaleI : public Expression3V
     float coef_f;
 public:
     EScaleI(int scalar);
+    int coefficient() const { return coef; }
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -157,7 +221,9 @@ class EScaleF : public Expression3V
     float coef;
 public:
     EScaleF(float scalar);
+    float coefficient() const { return coef; }
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
 
@@ -171,7 +237,9 @@ class EConstI : public Expression3V
     float value_f;
 public:
     EConstI(int c);
+    int get() const { return value; }
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
@@ -184,7 +252,9 @@ class EConstF : public Expression3V
     float value;
 public:
     EConstF(float c);
+    float get() const { return value; }
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
 
@@ -199,10 +269,50 @@ class EClampI : public Expression3V
     float low_f, high_f;
 public:
     EClampI(int low_, int high_);
+    int lowBound() const { return low; }
+    int highBound() const { return high; }
     virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
 
     virtual SmartSpan<float> evaluateF();
     virtual SmartSpan<int> evaluateI();
 
     virtual Interval getImage(Interval& x, Interval& y, Interval& z);
-};
\ No newline at end of file
+};
+
+// A subtree referenced from several places of the coordinate triplet, with
+// the spans it last evaluated to. All references hold the same slot, so the
+// subtree is evaluated once per pass; the cache is dropped when x/y or (for
+// z-dependent subtrees) z change.
+struct SharedSlot
+{
+    std::shared_ptr<Expression3V> target;
+    SmartSpan<float> cache_f;
+    SmartSpan<int>   cache_i;
+    bool  valid_f = false;
+    bool  valid_i = false;
+    float zf = 0.f;
+    int   zi = 0;
+};
+
+class EShared : public Expression3V
+{
+    std::shared_ptr<SharedSlot> pSlot;
+public:
+    EShared(std::shared_ptr<SharedSlot> pSlot_);
+    const Expression3V& target() const { return *pSlot->target; }
+    Expression3V& target() { return *pSlot->target; }
+    virtual bool isPrecise() const;
+    virtual ExprKind kind() const;
+    virtual int dependencies() const;
+
+    virtual void setVars(SmartSpan<float>* xf_, SmartSpan<float>* yf_);
+    virtual void setVars(SmartSpan<int>* xi_, SmartSpan<int>* yi_);
+    virtual void setZ(float zf_);
+    virtual void setZ(int zi_);
+
+    virtual SmartSpan<float> evaluateF();
+    virtual SmartSpan<int> evaluateI();
+
+    virtual Interval getImage(Interval& x, Interval& y, Interval& z);
+};
@@ -1,96 +1,220 @@
 #include "stdafx.h"
 #include "StringParser.h"
+#include "ExprOptimizer.h"
+#include "AllocCounter.h"
 #include "FilmWarp.h"
 
 using namespace std;
 using namespace cv;
 
+// "512M", "2g", "1000000": bytes with an optional binary k/m/g suffix
+size_t parseBytes(const string& text)
+{
+    size_t end = 0;
+    double value = stod(text, &end);
+    switch ((end < text.size()) ? tolower(text[end]) : 0)
+    {
+    case 'g': value *= 1024.; // fall through
+    case 'm': value *= 1024.; // fall through
+    case 'k': value *= 1024.; break;
+    }
+    return static_cast<size_t>(max(value, 0.));
+}
+
 int main(int argc, char *argv[])
 {
-    stringstream conv;
-    const string sourceReference = argv[1];
-    const string destReference = argv[2];
-    const string expression = argv[3];
+    try
+    {
+        stringstream conv;
+        const string sourceReference = argv[1];
+        const string destReference = argv[2];
+        const string expression = argv[3];
 
-    map<string, string> params;
+        map<string, string> params;
 
-    for (int a = 4; a < argc; a++)
-    {
-        string param = argv[a];
-        if (!param.empty() && param[0] == '-')
+        for (int a = 4; a < argc; a++)
         {
-            int spl = static_cast<int>(param.find('='));
-            params[param.substr(1, spl - 1)] = param.substr(spl + 1);
+            string param = argv[a];
+            if (!param.empty() && param[0] == '-')
+            {
+                int spl = static_cast<int>(param.find('='));
+                params[param.substr(1, spl - 1)] = param.substr(spl + 1);
+            }
         }
-    }
 
-    Video input(sourceReference);   
+        int in_frames = 0;
+        if (params.find("frames") != params.end())
+            in_frames = stoi(params["frames"]);
+
+        Video input(sourceReference, in_frames);
+
+        // a stream written to stdout leaves cout to the frames
+        PipeSpec out_pipe;
+        bool pipe_output = parsePipeSpec(destReference, out_pipe);
+        ostream& console = (pipe_output && (out_pipe.path == "-")) ? cerr : cout;
 
-    int out_w  = input.width();
-    int out_h  = input.height();
-    int out_fc = input.framecount();
-    double out_fps = input.fps();
+        if (params.find("store") != params.end())
+            input.useStore(params["store"]);
 
-    input.setMaxFrames(128);
+        if (params.find("cache") != params.end())
+        {
+            if (params["cache"] == std::string("yuv420"))
+                input.setFrameFormat(FrameFormat::YUV420);
+        }
 
-    FilmWarper fw;
-    StringParser sp;
+        int out_w  = input.width();
+        int out_h  = input.height();
+        int out_fc = input.framecount();
+        double out_fps = input.fps();
 
-    sp.setConsts(input.width(), input.height(), input.framecount());
+        FilmWarper fw;
+        StringParser sp;
 
-    if (params.find("s") != params.end())
-    {
-        auto sz_exprs = sp.parseExprTriplet(params["s"]);
-        SmartSpan<int> nvec_i(1, 0);
-        SmartSpan<float> nvec_f(1, 0.f);
+        sp.setConsts(input.width(), input.height(), input.framecount());
+
+        if (params.find("s") != params.end())
+        {
+            auto sz_exprs = sp.parseExprTriplet(params["s"]);
+            SmartSpan<int> nvec_i(1, 0);
+            SmartSpan<float> nvec_f(1, 0.f);
         
-        for (auto& pExpr : sz_exprs)
+            for (auto& pExpr : sz_exprs)
+            {
+                pExpr->setVars(&nvec_i, &nvec_i);
+                pExpr->setVars(&nvec_f, &nvec_f);
+                pExpr->setZ(0);
+                pExpr->setZ(0.f);
+            }
+
+            apply_result(sz_exprs[0], [&out_w](auto vec) { out_w = static_cast<int>(vec.data[0]); });
+            apply_result(sz_exprs[1], [&out_h](auto vec) { out_h = static_cast<int>(vec.data[0]); });
+            apply_result(sz_exprs[2], [&out_fc](auto vec) { out_fc = static_cast<int>(vec.data[0]); });
+        }
+
+        if (params.find("threads") != params.end())
         {
-            pExpr->setVars(&nvec_i, &nvec_i);
-            pExpr->setVars(&nvec_f, &nvec_f);
-            pExpr->setZ(0);
-            pExpr->setZ(0.f);
+            int threads = stoi(params["threads"]);
+            fw.setThreads((threads > 0) ? threads : static_cast<int>(thread::hardware_concurrency()));
         }
 
-        apply_result(sz_exprs[0], [&out_w](auto vec) { out_w = static_cast<int>(vec.data[0]); });
-        apply_result(sz_exprs[1], [&out_h](auto vec) { out_h = static_cast<int>(vec.data[0]); });
-        apply_result(sz_exprs[2], [&out_fc](auto vec) { out_fc = static_cast<int>(vec.data[0]); });
-    }
+        if (params.find("eval") != params.end())
+        {
+            if (params["eval"] == std::string("vm"))
+                fw.setEvalMode(EvalMode::VM);
+            else if (params["eval"] == std::string("jit"))
+                fw.setEvalMode(EvalMode::JIT);
+        }
 
-    if (params.find("p") != params.end())
-    {
-        if (params["p"] == std::string("1"))
+        if (params.find("scanline") != params.end())
+        {
+            if (params["scanline"] == std::string("0"))
+                fw.setScanline(false);
+        }
+
+        if (params.find("sampler") != params.end())
         {
-            fw.setFrameCallback([out_fc](int frame)
+            if (params["sampler"] == std::string("scalar"))
+                fw.setSampler(SamplerKind::Scalar);
+            else if ((params["sampler"] == std::string("avx2")) && cpuSupportsAVX2())
+                fw.setSampler(SamplerKind::AVX2);
+            else if (params["sampler"] == std::string("fixed"))
+                fw.setSampler(SamplerKind::Fixed);
+        }
+
+        // -p and -allocstats both watch frames; their callbacks run one after the other
+        std::vector<std::function<void(int)>> frame_callbacks;
+
+        if (params.find("p") != params.end())
+        {
+            if (params["p"] == std::string("1"))
             {
-                int percentage = (frame * 100) / out_fc;
-                cout << '\r' << percentage << "%   ";
-            });
+                frame_callbacks.push_back([out_fc, &console](int frame)
+                {
+                    int percentage = (frame * 100) / out_fc;
+                    console << '\r' << percentage << "%   ";
+                });
+            }
         }
-    }
     
-    std::unique_ptr<Recorder> dest = (out_fc>1)
-        ? std::unique_ptr<Recorder>(make_unique<VideoRecorder>(destReference, input.fourcc(), out_fps, cv::Size(out_w, out_h), out_fc))
-        : std::unique_ptr<Recorder>(make_unique<ImageRecorder>(destReference, cv::Size(out_w, out_h)));
+        if (params.find("allocstats") != params.end())
+        {
+            if (params["allocstats"] == std::string("1"))
+            {
+                // runs last and restarts the count after its own output, so a frame
+                // is only charged with what rendering it allocated
+                frame_callbacks.push_back([last = heapAllocationCount()](int frame) mutable
+                {
+                    size_t now = heapAllocationCount();
+                    cerr << "frame " << frame << ": " << (now - last) << " allocations" << endl;
+                    last = heapAllocationCount();
+                });
+            }
+        }
+
+        if (!frame_callbacks.empty())
+        {
+            fw.setFrameCallback([frame_callbacks](int frame)
+            {
+                for (auto& callback : frame_callbacks)
+                    callback(frame);
+            });
+        }
+
+        size_t memory_budget = 0;
+        if (params.find("mem") != params.end())
+            memory_budget = parseBytes(params["mem"]);
+
+        std::unique_ptr<Recorder> dest = pipe_output
+            ? std::unique_ptr<Recorder>(make_unique<PipeRecorder>(out_pipe, out_fps, cv::Size(out_w, out_h), out_fc))
+            : (out_fc>1)
+            ? std::unique_ptr<Recorder>(make_unique<VideoRecorder>(destReference, input.fourcc(), out_fps, cv::Size(out_w, out_h), out_fc))
+            : std::unique_ptr<Recorder>(make_unique<ImageRecorder>(destReference, cv::Size(out_w, out_h)));
     
-    std::array<std::unique_ptr<Expression3V>, 3> coord_exprs = sp.parseExprTriplet(expression);
+        if (params.find("pipeline") != params.end())
+        {
+            if (params["pipeline"] == std::string("1"))
+            {
+                // the queue holds its frames plus the one being encoded, and takes
+                // at most an eighth of the memory budget
+                size_t out_bytes = static_cast<size_t>(out_w) * out_h * 3;
+                int queue_length = memory_budget ? static_cast<int>(min<size_t>(memory_budget / 8 / out_bytes, 9)) - 1 : 8;
+                queue_length = max(queue_length, 1);
+                size_t queue_bytes = (queue_length + 1) * out_bytes;
+                if (memory_budget)
+                    memory_budget = (memory_budget > queue_bytes) ? (memory_budget - queue_bytes) : 1;
+
+                fw.setPipelined(true);
+                dest = make_unique<AsyncRecorder>(move(dest), queue_length);
+            }
+        }
+
+        if (memory_budget)
+            fw.setMemoryBudget(memory_budget);
 
-   // input.loadFrame(0, input.framecount());
+        std::array<std::unique_ptr<Expression3V>, 3> coord_exprs = sp.parseExprTriplet(expression);
 
-    auto x_clamp = make_unique<EClampI>(0, input.width()-1);
-    auto y_clamp = make_unique<EClampI>(0, input.height()-1);
-    auto z_clamp = make_unique<EClampI>(0, input.framecount()-1);
+       // input.loadFrame(0, input.framecount());
 
-    x_clamp->addChild(move(coord_exprs[0]));
-    y_clamp->addChild(move(coord_exprs[1]));
-    z_clamp->addChild(move(coord_exprs[2]));
+        prepareTriplet(coord_exprs, input.width(), input.height(), input.framecount());
 
-    coord_exprs[0] = move(x_clamp);
-    coord_exprs[1] = move(y_clamp);
-    coord_exprs[2] = move(z_clamp);
 
+        fw.process(input, *dest, coord_exprs);
 
-    fw.process(input, *dest, coord_exprs);
+        if (params.find("seekstats") != params.end())
+        {
+            if (params["seekstats"] == std::string("1"))
+            {
+                SeekStats stats = input.seekStats();
+                cerr << "seeks: " << stats.hits << " hits, " << stats.misses << " misses, "
+                    << stats.skipped << " frames decoded and skipped" << endl;
+            }
+        }
 
-    return 0;
+        return 0;
+    }
+    catch (const IOError& e)
+    {
+        cerr << e.message << endl;
+        return 1;
+    }
 }
\ No newline at end of file
@@ -1,59 +1,171 @@
 #pragma once
 
 #include "Expression3V.h"
+#include "ExprProgram.h"
+#include "ExprJit.h"
 #include "Video.h"
 #include "Recorder.h"
+#include "WorkerPool.h"
+#include "Sampler.h"
+#include "ScanlineWarp.h"
+#include "AccessPlan.h"
+
+enum class EvalMode
+{
+    Tree,
+    VM,
+    JIT,
+    Scanline    // picked automatically for affine/projective triplets, see ScanlineWarp.h
+};
+
+// How a static x/y coordinate is stored: a full frame of values, one row
+// shared by every row (expression of x only) or one value per row (y only).
+enum class CoordLayout
+{
+    Frame,
+    Row,
+    Column
+};
+
+inline CoordLayout coordLayout(const Expression3V& expr)
+{
+    int deps = expr.dependencies();
+    if (!(deps & ~VarX))
+        return CoordLayout::Row;
+    if (!(deps & ~VarY))
+        return CoordLayout::Column;
+    return CoordLayout::Frame;
+}
 
 class FilmWarper
 {
     std::function<void(int)> callback_onframe;
-
-    template<class T> SmartSpan<T> evaluate(std::unique_ptr<Expression3V>& pExpr)
+    std::unique_ptr<WorkerPool> workers;
+    bool pipelined = false;
+    bool scanline = true;
+    SamplerKind sampler = bestSampler();
+    EvalMode eval = EvalMode::Tree;
+    size_t memory_budget = 0;
+
+    // source frames cached when there is no memory budget to size the cache from
+    static const int default_cache_frames = 128;
+
+    // member templates cannot be specialized in class scope, so the value type picks an overload
+    SmartSpan<int> evaluateAs(std::unique_ptr<Expression3V>& pExpr, int*)
     {
         return pExpr->evaluateI();
     }
 
-    template<> SmartSpan<float> evaluate(std::unique_ptr<Expression3V>& pExpr)
+    SmartSpan<float> evaluateAs(std::unique_ptr<Expression3V>& pExpr, float*)
     {
         return pExpr->evaluateF();
     }
 
-    template<class XT, class YT, class ZT>
-    void process3(Video& input, Recorder& dest, std::array<std::unique_ptr<Expression3V>, 3>& coord_exprs)
+    template<class T> SmartSpan<T> evaluate(std::unique_ptr<Expression3V>& pExpr)
     {
-        Mat frame = dest.getSampleFrame();
+        return evaluateAs(pExpr, static_cast<T*>(nullptr));
+    }
 
-        int pixel_amount = dest.width() * dest.height();
+    // Values are written into the plane rather than swapped with it: a swap
+    // would hand a pooled buffer to the plane and leave the pool one short.
+    template<class T> static void evaluateInto(const SmartSpan<T>& vals, std::vector<T>& dense)
+    {
+        dense.resize(vals.size);
+        vals.foreach([&](int i, T val) { dense[i] = val; });
+    }
 
-        SmartSpan<int> coord_x, coord_y;
-        SmartSpan<float> coord_xf, coord_yf;
+    template<class T> void evaluateDense(std::unique_ptr<Expression3V>& pExpr, std::vector<T>& dense)
+    {
+        SmartSpan<T> vals = evaluate<T>(pExpr);
+        evaluateInto(vals, dense);
+    }
 
-        coord_x.size = coord_y.size = coord_xf.size = coord_yf.size = pixel_amount;
+    // Keeps a result that stayed affine as is, its rows are generated while
+    // sampling; anything else is expanded into dense values.
+    template<class T> void evaluatePlane(std::unique_ptr<Expression3V>& pExpr, std::vector<T>& dense, SmartSpan<T>& affine)
+    {
+        SmartSpan<T> vals = evaluate<T>(pExpr);
+        if (vals.type == SpanType::Affine2D)
+        {
+            affine = vals;
+            return;
+        }
 
-        coord_x.type = coord_xf.type = SpanType::SparseLinear;
-        coord_y.type = coord_yf.type = SpanType::Sparse;
+        affine.type = SpanType::Sparse;
+        evaluateInto(vals, dense);
+    }
 
-        coord_x.offsets.clear();
+    // The affine holders keep storage of their own, copied into in place, so a
+    // plane that turns affine mid-clip does not take a buffer from the pool.
+    template<class T> static void reserveAffine(SmartSpan<T>& affine)
+    {
+        affine.data.reserve(3);
+        affine.offsets.reserve(2);
+    }
 
-        for (int i = 0; i < dest.height() + 1; i++)
-            coord_x.offsets.push_back(i*dest.width());
+    template<class T> void evaluateAxis(std::unique_ptr<Expression3V>& pExpr, CoordLayout layout, int n, std::vector<T>& table)
+    {
+        SmartSpan<int> axis_x(n), axis_y(n);
+        SmartSpan<float> axis_xf(n), axis_yf(n);
 
-        coord_y.offsets = coord_xf.offsets = coord_yf.offsets = coord_x.offsets;
+        if (layout == CoordLayout::Row)
+        {
+            axis_x.type = axis_xf.type = SpanType::SparseLinear;
+            axis_x.data = { 0, 1 };
+            axis_xf.data = { 0.f, 1.f };
+        }
+        else
+        {
+            axis_y.type = axis_yf.type = SpanType::Dense;
+            axis_y.data.resize(n);
+            axis_yf.data.resize(n);
+            for (int i = 0; i < n; i++)
+            {
+                axis_y.data[i] = i;
+                axis_yf.data[i] = static_cast<float>(i);
+            }
+        }
 
-        coord_x.data.clear();
-        coord_xf.data.clear();
-        coord_y.data.clear();
-        coord_yf.data.clear();
+        pExpr->setVars(&axis_x, &axis_y);
+        pExpr->setVars(&axis_xf, &axis_yf);
+        evaluateDense(pExpr, table);
+    }
 
-        for (int i = 0; i < dest.height(); i++)
+    // Source frames each output frame samples, from interval analysis of z over
+    // the whole output plane; a fractional z also reads the following frame.
+    std::vector<FrameNeed> frameNeeds(Expression3V& z_expr, int out_frames, int source_frames, bool integral, Interval x, Interval y)
+    {
+        std::vector<FrameNeed> needs(out_frames);
+        int last_frame = std::max(source_frames - 1, 0);
+        for (int f = 0; f < out_frames; f++)
         {
-            coord_x.data.push_back(0);
-            coord_x.data.push_back(1);
-            coord_xf.data.push_back(0.f);
-            coord_xf.data.push_back(1.f);
-            coord_y.data.push_back(i);
-            coord_yf.data.push_back(static_cast<float>(i));
+            Interval z{ static_cast<float>(f), static_cast<float>(f) };
+            Interval image = z_expr.getImage(x, y, z);
+
+            // float evaluation rounds differently from the analysis, so leave some slack
+            if (!integral)
+            {
+                image.a -= 1e-4f * (1.f + std::fabs(image.a));
+                image.b += 1e-4f * (1.f + std::fabs(image.b));
+            }
+
+            // written so that NaN bounds select the whole source
+            int first = (image.a >= 0.f) ? std::min(static_cast<int>(std::floor(image.a)), last_frame) : 0;
+            int last = (image.b < static_cast<float>(last_frame)) ? static_cast<int>(std::floor(image.b)) + (integral ? 0 : 1) : last_frame;
+            needs[f] = FrameNeed{ first, std::max(first, std::min(last, last_frame)) };
         }
+        return needs;
+    }
+
+    template<class XT, class YT, class ZT>
+    void process3(Video& input, Recorder& dest, std::array<std::unique_ptr<Expression3V>, 3>& coord_exprs)
+    {
+        int pixel_amount = dest.width() * dest.height();
+
+        SmartSpan<int> coord_x = affine_span(pixel_amount, dest.width(), 0, 1, 0);
+        SmartSpan<int> coord_y = affine_span(pixel_amount, dest.width(), 0, 0, 1);
+        SmartSpan<float> coord_xf = affine_span(pixel_amount, dest.width(), 0.f, 1.f, 0.f);
+        SmartSpan<float> coord_yf = affine_span(pixel_amount, dest.width(), 0.f, 0.f, 1.f);
 
         for (auto &expr : coord_exprs)
         {
@@ -61,19 +173,178 @@ class FilmWarper
             expr->setVars(&coord_xf, &coord_yf);
         }
 
+        typedef typename std::common_type<XT, YT>::type XYT;
+
+        std::vector<XYT> xvals, yvals;
+        std::vector<ZT>  zvals;
+        std::array<SmartSpan<XYT>, 2> xy_affine;
+        SmartSpan<ZT> z_affine;
+        reserveAffine(xy_affine[0]);
+        reserveAffine(xy_affine[1]);
+        reserveAffine(z_affine);
+
+        std::array<std::vector<XYT>*, 2> xy_vals{ { &xvals, &yvals } };
+        std::array<bool, 2> xy_static;
+        std::array<CoordLayout, 2> xy_layout;
+        for (int c = 0; c < 2; c++)
+        {
+            xy_static[c] = !(coord_exprs[c]->dependencies() & VarZ);
+            xy_layout[c] = coordLayout(*coord_exprs[c]);
+        }
+
         Interval full_x{ 0.f, static_cast<float>(dest.width()) };
         Interval full_y{ 0.f, static_cast<float>(dest.height()) };
 
 
-        const int bstep = 24;
-        for (int bstart = 0, bend = min(bstart+bstep, dest.framecount()); bstart < dest.framecount(); bstart = bend, bend = min(bstart + bstep, dest.framecount()))
+        int bands = workers ? workers->size() * 4 : 1;
+        int band_rows = (dest.height() + bands - 1) / bands;
+        bands = (dest.height() + band_rows - 1) / band_rows;
+
+        ExprProgram xy_program, z_program;
+        std::vector<int> xy_dynamic;
+        std::vector<ExprVM<XYT>> xy_vm;
+        std::vector<ExprVM<ZT>> z_vm;
+        std::unique_ptr<ExprJit> xy_jit, z_jit;
+        std::vector<JitRunner<XYT>> xy_runner;
+        std::vector<JitRunner<ZT>> z_runner;
+
+        std::array<ProjectiveForm, 3> forms;
+        bool projective = scanline &&
+            projectiveForm(*coord_exprs[0], std::is_integral<XYT>::value, forms[0]) &&
+            projectiveForm(*coord_exprs[1], std::is_integral<XYT>::value, forms[1]) &&
+            projectiveForm(*coord_exprs[2], std::is_integral<ZT>::value, forms[2]);
+
+        EvalMode mode = projective ? EvalMode::Scanline : eval;
+        if ((mode == EvalMode::JIT) && !ExprJit::available())
+            mode = EvalMode::Tree;
+
+        if ((mode == EvalMode::VM) || (mode == EvalMode::JIT))
+        {
+            // dynamic coordinates are evaluated one row at a time right before
+            // sampling, so only the static tables are frame-sized
+            std::vector<const Expression3V*> dynamic_roots;
+            for (int c = 0; c < 2; c++)
+            {
+                if (!xy_static[c])
+                {
+                    dynamic_roots.push_back(coord_exprs[c].get());
+                    xy_dynamic.push_back(c);
+                    continue;
+                }
+
+                // a Column table is a frame one pixel wide, so LoadY yields the row
+                int table_width = (xy_layout[c] == CoordLayout::Column) ? 1 : dest.width();
+                int table_size = (xy_layout[c] == CoordLayout::Row) ? dest.width() :
+                    ((xy_layout[c] == CoordLayout::Column) ? dest.height() : pixel_amount);
+
+                XYT* out = (xy_vals[c]->resize(table_size), xy_vals[c]->data());
+                ExprVM<XYT>(ExprProgram({ coord_exprs[c].get() })).run(0, table_size, table_width, XYT(0), &out);
+            }
+
+            xy_program = ExprProgram(dynamic_roots);
+            z_program = ExprProgram({ coord_exprs[2].get() });
+            xy_vm.assign(bands, ExprVM<XYT>(xy_program));
+            z_vm.assign(bands, ExprVM<ZT>(z_program));
+
+            if (mode == EvalMode::JIT)
+            {
+                xy_jit = std::make_unique<ExprJit>(xy_program, std::is_floating_point<XYT>::value);
+                z_jit = std::make_unique<ExprJit>(z_program, std::is_floating_point<ZT>::value);
+
+                bool valid = xy_jit->compiled() && z_jit->compiled() &&
+                    verifyJit<XYT>(*xy_jit, xy_program, dest.width(), dest.height(), XYT(1)) &&
+                    verifyJit<ZT>(*z_jit, z_program, dest.width(), dest.height(), ZT(1));
+
+                if (valid)
+                {
+                    xy_runner.assign(bands, JitRunner<XYT>(*xy_jit, dest.width()));
+                    z_runner.assign(bands, JitRunner<ZT>(*z_jit, dest.width()));
+                }
+                else
+                {
+                    mode = EvalMode::VM;
+                }
+            }
+        }
+        else if (mode == EvalMode::Tree)
+        {
+            for (int c = 0; c < 2; c++)
+            {
+                if (!xy_static[c])
+                    continue;
+
+                if (xy_layout[c] == CoordLayout::Frame)
+                {
+                    evaluatePlane(coord_exprs[c], *xy_vals[c], xy_affine[c]);
+                }
+                else
+                {
+                    evaluateAxis(coord_exprs[c], xy_layout[c], (xy_layout[c] == CoordLayout::Row) ? dest.width() : dest.height(), *xy_vals[c]);
+                    coord_exprs[c]->setVars(&coord_x, &coord_y);
+                    coord_exprs[c]->setVars(&coord_xf, &coord_yf);
+                }
+            }
+        }
+
+        std::vector<std::vector<XYT>> row_buffers(bands * 2, std::vector<XYT>(dest.width()));
+        std::vector<std::vector<ZT>> z_buffers(bands, std::vector<ZT>(dest.width()));
+
+        std::vector<std::vector<XYT*>> xy_row_out(bands);
+        for (int band = 0; band < bands; band++)
+            for (int c : xy_dynamic)
+                xy_row_out[band].push_back(row_buffers[2 * band + c].data());
+
+        int bstep = 24;
+        int cache_frames = default_cache_frames;
+        if (memory_budget)
+        {
+            // whatever the coordinates and the output frame leave goes to source frames
+            size_t coord_bytes = (xvals.capacity() + yvals.capacity()) * sizeof(XYT) + zvals.capacity() * sizeof(ZT) +
+                bands * dest.width() * (2 * sizeof(XYT) + sizeof(ZT));
+            if (mode == EvalMode::Tree)
+                coord_bytes += 2 * static_cast<size_t>(pixel_amount) * (2 * sizeof(XYT) + sizeof(ZT));
+
+            // the process itself and the codecs' own frame buffers are a guess
+            size_t source_frame_bytes = input.frameBytes();
+            size_t output_frame_bytes = static_cast<size_t>(pixel_amount) * 3;
+            size_t reserve = (16 << 20) + 4 * source_frame_bytes + 4 * output_frame_bytes;
+
+            size_t used = reserve + coord_bytes + output_frame_bytes;
+            cache_frames = (memory_budget > used) ? static_cast<int>(std::min<size_t>((memory_budget - used) / source_frame_bytes, std::numeric_limits<int>::max())) : 0;
+            cache_frames = std::max(cache_frames, 2);
+            input.setMaxFrames(cache_frames);
+
+            // a step may then be as long as its source span allows, and the
+            // frames the next step decodes in the background fit alongside
+            bstep = cache_frames;
+            if (pipelined)
+                cache_frames = std::max(cache_frames / 2, 2);
+        }
+        else
+            input.setMaxFrames(cache_frames);
+
+        std::vector<FrameNeed> needs = frameNeeds(*coord_exprs[2], dest.framecount(), input.framecount(), std::is_integral<ZT>::value, full_x, full_y);
+        std::vector<AccessStep> plan = planAccess(needs, cache_frames, bstep, Video::skip_limit);
+
+        // streamed input is read once, so every frame must still be in the
+        // look-back window when it is sampled
+        if (input.streaming())
+        {
+            int window = lookBack(needs, plan);
+            if (window > input.max_frames())
+                throw IOError{ "The warp looks back " + std::to_string(window) + " frames into the input stream, but only " +
+                    std::to_string(input.max_frames()) + " are kept (raise -mem)" };
+        }
+
+        for (size_t step = 0; step < plan.size(); step++)
         {
-            Interval zint{ static_cast<float>(bstart),static_cast<float>(bend) };
-            auto frame_span = coord_exprs[2]->getImage(full_x, full_y, zint);
+            input.releaseFrames(plan[step].evict);
+            input.loadFrames(plan[step].load);
 
-            input.loadFrame(static_cast<int>(frame_span.a), static_cast<int>(frame_span.b) + 2);
+            if (pipelined && (step + 1 < plan.size()))
+                input.prefetch(plan[step + 1].load);
 
-            for (int f = bstart; f < bend; f++)
+            for (int f = plan[step].out_begin; f < plan[step].out_end; f++)
             {
                 float ft = static_cast<float>(f);
                 for (auto &expr : coord_exprs)
@@ -82,48 +353,107 @@ class FilmWarper
                     expr->setZ(ft);
                 }
 
-                SmartSpan<std::common_type<XT, YT>::type> xvals_s = evaluate<std::common_type<XT, YT>::type>(coord_exprs[0]);
-                SmartSpan<std::common_type<XT, YT>::type> yvals_s = evaluate<std::common_type<XT, YT>::type>(coord_exprs[1]);
-                SmartSpan<ZT>                             zvals_s = evaluate<ZT>(coord_exprs[2]);
-
-                xvals_s.to_dense();
-                yvals_s.to_dense();
-                zvals_s.to_dense();
+                if (mode == EvalMode::Scanline)
+                {
+                    projectiveForm(*coord_exprs[0], std::is_integral<XYT>::value, forms[0]);
+                    projectiveForm(*coord_exprs[1], std::is_integral<XYT>::value, forms[1]);
+                    projectiveForm(*coord_exprs[2], std::is_integral<ZT>::value, forms[2]);
+                }
+                else if (mode == EvalMode::Tree)
+                {
+                    for (int c = 0; c < 2; c++)
+                        if (!xy_static[c])
+                            evaluatePlane(coord_exprs[c], *xy_vals[c], xy_affine[c]);
+                    evaluatePlane(coord_exprs[2], zvals, z_affine);
+                }
 
-                auto xvals = xvals_s.data;
-                auto yvals = yvals_s.data;
-                auto zvals = zvals_s.data;
+                const Video& source = input;
+                cv::Mat frame = dest.acquireFrame();
 
+                auto render_band = [&](int band)
+                {
+                    int row_begin = band * band_rows;
+                    int row_end = std::min(row_begin + band_rows, dest.height());
 
+                    if (mode == EvalMode::Scanline)
+                    {
+                        for (int i = row_begin; i < row_end; ++i)
+                            warpRow<XYT, ZT>(sampler, source, forms, i, dest.width(), frame.data + frame.step[0] * i);
+                        return;
+                    }
 
-                int offset = 0;
+                    bool fused = (mode == EvalMode::VM) || (mode == EvalMode::JIT);
+                    ZT* z_out = z_buffers[band].data();
 
-                for (int i = 0; i < dest.height(); ++i)
-                    for (int j = 0; j < dest.width(); ++j)
+                    for (int i = row_begin; i < row_end; ++i)
                     {
-                        unsigned char* ptr = frame.data + frame.step[0] * i + frame.step[1] * j;
-                        Color8 c = compress(input.pixel(xvals[offset], yvals[offset], zvals[offset]));
-                        offset++;
-                        ptr[0] = c.r;
-                        ptr[1] = c.g;
-                        ptr[2] = c.b;
+                        int offset = i * dest.width();
+
+                        // the row's coordinates stay in the band buffers (and in
+                        // cache) from evaluation through sampling
+                        if (mode == EvalMode::VM)
+                        {
+                            if (!xy_program.empty())
+                                xy_vm[band].runInto(offset, dest.width(), dest.width(), static_cast<XYT>(f), xy_row_out[band].data());
+                            z_vm[band].runInto(offset, dest.width(), dest.width(), static_cast<ZT>(f), &z_out);
+                        }
+                        else if (mode == EvalMode::JIT)
+                        {
+                            if (!xy_program.empty())
+                                xy_runner[band].runInto(offset, dest.width(), dest.width(), static_cast<XYT>(f), xy_row_out[band].data());
+                            z_runner[band].runInto(offset, dest.width(), dest.width(), static_cast<ZT>(f), &z_out);
+                        }
+
+                        std::array<const XYT*, 2> rows;
+                        for (int c = 0; c < 2; c++)
+                        {
+                            if (fused && !xy_static[c])
+                            {
+                                rows[c] = row_buffers[2 * band + c].data();
+                            }
+                            else if (xy_affine[c].type == SpanType::Affine2D)
+                            {
+                                xy_affine[c].fill_row(i, row_buffers[2 * band + c].data());
+                                rows[c] = row_buffers[2 * band + c].data();
+                            }
+                            else if (!xy_static[c] || (xy_layout[c] == CoordLayout::Frame))
+                            {
+                                rows[c] = xy_vals[c]->data() + offset;
+                            }
+                            else if (xy_layout[c] == CoordLayout::Row)
+                            {
+                                rows[c] = xy_vals[c]->data();
+                            }
+                            else
+                            {
+                                std::vector<XYT>& buffer = row_buffers[2 * band + c];
+                                if (i == row_begin || ((*xy_vals[c])[i] != (*xy_vals[c])[i - 1]))
+                                    std::fill(buffer.begin(), buffer.end(), (*xy_vals[c])[i]);
+                                rows[c] = buffer.data();
+                            }
+                        }
+
+                        const ZT* z_row = fused ? z_out : (zvals.data() + offset);
+                        if (z_affine.type == SpanType::Affine2D)
+                        {
+                            z_affine.fill_row(i, z_buffers[band].data());
+                            z_row = z_buffers[band].data();
+                        }
+
+                        sampleRow(sampler, source, rows[0], rows[1], z_row,
+                            dest.width(), frame.data + frame.step[0] * i);
                     }
+                };
 
-                dest.pushFrame(frame);
+                if (workers)
+                    workers->run(bands, std::ref(render_band));
+                else
+                    render_band(0);
+
+                dest.submitFrame(frame);
                 if(callback_onframe)
                     callback_onframe(f);
             }
-
-            zint = Interval{ static_cast<float>(bend), static_cast<float>(dest.framecount()) };
-            auto frame_togo = coord_exprs[2]->getImage(full_x, full_y, zint);
-
-            while ((length(zint) > bstep) && (length(frame_togo) > input.max_frames()))
-            {
-                zint.b = zint.a + (zint.b - zint.a) / 2;
-                frame_togo = coord_exprs[2]->getImage(full_x, full_y, zint);
-            }
-
-            input.keepFrames(static_cast<int>(frame_togo.a), static_cast<int>(frame_togo.b) + 2);
         }
     }
 
@@ -170,6 +500,41 @@ public:
     {
         callback_onframe = func;
     }
+
+    void setPipelined(bool enable)
+    {
+        pipelined = enable;
+    }
+
+    void setScanline(bool enable)
+    {
+        scanline = enable;
+    }
+
+    void setEvalMode(EvalMode mode)
+    {
+        eval = mode;
+    }
+
+    void setSampler(SamplerKind kind)
+    {
+        sampler = kind;
+    }
+
+    // Bytes the source frame cache and coordinate buffers may use together;
+    // 0 caches default_cache_frames source frames whatever their size.
+    void setMemoryBudget(size_t bytes)
+    {
+        memory_budget = bytes;
+    }
+
+    void setThreads(int threads)
+    {
+        if (threads > 1)
+            workers = std::make_unique<WorkerPool>(threads);
+        else
+            workers.reset();
+    }
 };
 
 
@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "FrameCache.h"
+
+using namespace std;
+using namespace cv;
+
+FrameCache::FrameCache() : slots(1), slot_frame(1, -1), mask(0), lowest(0), highest(-1), live(0)
+{}
+
+void FrameCache::grow(int span)
+{
+    int capacity = mask + 1;
+    while (capacity < span)
+        capacity *= 2;
+
+    if (capacity == mask + 1)
+        return;
+
+    vector<Mat> nslots(capacity);
+    vector<int> nframes(capacity, -1);
+
+    for (int s = 0; s <= mask; s++)
+    {
+        int f = slot_frame[s];
+        if (f < 0)
+            continue;
+        nslots[f & (capacity - 1)] = slots[s];
+        nframes[f & (capacity - 1)] = f;
+    }
+
+    slots = move(nslots);
+    slot_frame = move(nframes);
+    mask = capacity - 1;
+}
+
+void FrameCache::updateBounds()
+{
+    lowest = 0;
+    highest = -1;
+    bool first = true;
+    for (int f : slot_frame)
+    {
+        if (f < 0)
+            continue;
+        lowest = first ? f : min(lowest, f);
+        highest = first ? f : max(highest, f);
+        first = false;
+    }
+}
+
+int FrameCache::claim(int frame)
+{
+    int lo = live ? min(lowest, frame) : frame;
+    int hi = live ? max(highest, frame) : frame;
+    grow(hi - lo + 1);
+
+    int s = frame & mask;
+    slot_frame[s] = frame;
+    lowest = lo;
+    highest = hi;
+    live++;
+    return s;
+}
+
+cv::Mat& FrameCache::acquire(int frame)
+{
+    if (contains(frame))
+        return slots[frame & mask];
+
+    int s = claim(frame);
+    slots[s] = recycle();
+    return slots[s];
+}
+
+void FrameCache::insert(int frame, const cv::Mat& image)
+{
+    int s = contains(frame) ? (frame & mask) : claim(frame);
+    slots[s] = image;
+}
+
+cv::Mat FrameCache::recycle()
+{
+    if (pool.empty())
+        return Mat();
+
+    Mat buffer = pool.back();
+    pool.pop_back();
+    return buffer;
+}
+
+void FrameCache::release(int frame)
+{
+    if (!contains(frame))
+        return;
+
+    int s = frame & mask;
+    if (!slots[s].empty())
+        pool.push_back(slots[s]);
+    slots[s] = Mat();
+    slot_frame[s] = -1;
+    live--;
+
+    if ((frame == lowest) || (frame == highest))
+        updateBounds();
+}
+
+void FrameCache::retain(int from, int to)
+{
+    for (int s = 0; s <= mask; s++)
+    {
+        int f = slot_frame[s];
+        if ((f < 0) || ((f >= from) && (f < to)))
+            continue;
+        if (!slots[s].empty())
+            pool.push_back(slots[s]);
+        slots[s] = Mat();
+        slot_frame[s] = -1;
+        live--;
+    }
+    updateBounds();
+}
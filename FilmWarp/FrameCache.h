@@ -0,0 +1,37 @@
+#pragma once
+
+class FrameCache
+{
+    std::vector<cv::Mat> slots;
+    std::vector<int>     slot_frame;
+    std::vector<cv::Mat> pool;
+
+    int mask;
+    int lowest;
+    int highest;
+    int live;
+
+    void grow(int span);
+    void updateBounds();
+    int  claim(int frame);
+public:
+    FrameCache();
+
+    bool contains(int frame) const
+    {
+        return (frame >= 0) && (slot_frame[frame & mask] == frame);
+    }
+
+    const cv::Mat& operator[](int frame) const
+    {
+        return slots[frame & mask];
+    }
+
+    cv::Mat& acquire(int frame);
+    void insert(int frame, const cv::Mat& image);
+    cv::Mat recycle();
+    void release(int frame);
+    void retain(int from, int to);
+
+    int size() const { return live; }
+};
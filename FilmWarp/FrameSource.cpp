@@ -0,0 +1,246 @@
+#include "stdafx.h"
+#include "FrameSource.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+namespace
+{
+    const size_t pipe_buffer = 4 << 20;
+}
+
+CaptureSource::CaptureSource(const std::string& filename) : capture(filename), file(filename)
+{
+    if (!capture.isOpened())
+        throw IOError{ "Could not open input file" };
+}
+
+void CaptureSource::read(cv::Mat& frame)
+{
+    capture >> frame;
+}
+
+void CaptureSource::grab()
+{
+    capture.grab();
+}
+
+bool CaptureSource::seek(int frame)
+{
+    return capture.set(CAP_PROP_POS_FRAMES, frame) &&
+        (static_cast<int>(capture.get(CAP_PROP_POS_FRAMES)) == frame);
+}
+
+bool CaptureSource::rewind()
+{
+    capture.release();
+    capture.open(file);
+    return capture.isOpened();
+}
+
+cv::Size CaptureSource::size() const
+{
+    return Size(static_cast<int>(capture.get(CAP_PROP_FRAME_WIDTH)),
+        static_cast<int>(capture.get(CAP_PROP_FRAME_HEIGHT)));
+}
+
+double CaptureSource::fps() const
+{
+    return capture.get(CAP_PROP_FPS);
+}
+
+int CaptureSource::framecount() const
+{
+    return static_cast<int>(capture.get(CAP_PROP_FRAME_COUNT));
+}
+
+int CaptureSource::fourcc() const
+{
+    return static_cast<int>(capture.get(CAP_PROP_FOURCC));
+}
+
+bool parsePipeSpec(const std::string& reference, PipeSpec& spec)
+{
+    spec = PipeSpec{ PipeFormat::Y4M, Size(), 25.0, "" };
+
+    if (reference.compare(0, 4, "y4m:") == 0)
+    {
+        spec.path = reference.substr(4);
+        return true;
+    }
+
+    if (reference.compare(0, 4, "bgr:") != 0)
+        return false;
+
+    spec.format = PipeFormat::BGR;
+    spec.path = reference.substr(4);
+
+    // optional "WxH@fps:" in front of the path
+    size_t colon = spec.path.find(':');
+    size_t cross = spec.path.find('x');
+    if ((colon == string::npos) || (cross == string::npos) || (cross > colon) || !isdigit(spec.path[0]))
+        return true;
+
+    string geometry = spec.path.substr(0, colon);
+    size_t at = geometry.find('@');
+    try
+    {
+        spec.size = Size(stoi(geometry.substr(0, cross)), stoi(geometry.substr(cross + 1, at - cross - 1)));
+        if (at != string::npos)
+            spec.fps = stod(geometry.substr(at + 1));
+    }
+    catch (const logic_error&)
+    {
+        throw IOError{ "Malformed raw stream geometry: " + geometry };
+    }
+
+    spec.path = spec.path.substr(colon + 1);
+    return true;
+}
+
+FILE* openPipe(const std::string& path, bool output)
+{
+    FILE* pipe = nullptr;
+    if (path == "-")
+    {
+        pipe = output ? stdout : stdin;
+#ifdef _WIN32
+        _setmode(_fileno(pipe), _O_BINARY);
+#endif
+    }
+    else
+    {
+#ifdef _MSC_VER
+        fopen_s(&pipe, path.c_str(), output ? "wb" : "rb");
+#else
+        pipe = fopen(path.c_str(), output ? "wb" : "rb");
+#endif
+    }
+
+    if (!pipe)
+        throw IOError{ output ? "Could not open output stream" : "Could not open input stream" };
+
+    setvbuf(pipe, nullptr, _IOFBF, pipe_buffer);
+    return pipe;
+}
+
+void closePipe(FILE* pipe)
+{
+    if ((pipe == stdin) || (pipe == stdout))
+        fflush(pipe);
+    else
+        fclose(pipe);
+}
+
+PipeSource::PipeSource(const PipeSpec& spec, int frames)
+    : in(openPipe(spec.path, false)), format(spec.format), resolution(spec.size), rate(spec.fps), frame_count(frames)
+{
+    if (format == PipeFormat::Y4M)
+        readHeader();
+    else if (resolution.area() <= 0)
+        throw IOError{ "Raw BGR input needs its frame size (bgr:WxH@fps:path)" };
+}
+
+PipeSource::~PipeSource()
+{
+    closePipe(in);
+}
+
+bool PipeSource::readLine(std::string& line)
+{
+    line.clear();
+    int c;
+    while (((c = fgetc(in)) != EOF) && (c != '\n'))
+        line += static_cast<char>(c);
+    return (c != EOF) || !line.empty();
+}
+
+void PipeSource::readHeader()
+{
+    string line;
+    if (!readLine(line) || (line.compare(0, 10, "YUV4MPEG2 ") != 0))
+        throw IOError{ "Input stream is not YUV4MPEG2" };
+
+    istringstream tokens(line.substr(10));
+    for (string t; tokens >> t;)
+    {
+        switch (t[0])
+        {
+        case 'W': resolution.width = stoi(t.substr(1)); break;
+        case 'H': resolution.height = stoi(t.substr(1)); break;
+        case 'F':
+        {
+            size_t colon = t.find(':');
+            double den = (colon == string::npos) ? 1.0 : stod(t.substr(colon + 1));
+            if (den > 0.0)
+                rate = stod(t.substr(1, colon - 1)) / den;
+            break;
+        }
+        case 'C':
+            // the 8-bit 4:2:0 chroma sitings; C420p10 and the like carry 16-bit samples
+            if ((t != "C420") && (t != "C420jpeg") && (t != "C420paldv") && (t != "C420mpeg2"))
+                throw IOError{ (t.compare(1, 3, "420") == 0) ? "Only 8-bit YUV4MPEG2 input is supported (got " + t + ")"
+                    : "Only 4:2:0 YUV4MPEG2 input is supported" };
+            break;
+        }
+    }
+
+    if ((resolution.area() <= 0) || (resolution.width % 2) || (resolution.height % 2))
+        throw IOError{ "YUV4MPEG2 input needs an even, non-zero frame size" };
+}
+
+void PipeSource::read(cv::Mat& frame)
+{
+    if (format == PipeFormat::BGR)
+    {
+        frame.create(resolution, CV_8UC3);
+        size_t bytes = static_cast<size_t>(resolution.area()) * 3;
+        if (!frame.isContinuous() || (fread(frame.data, 1, bytes, in) != bytes))
+            frame.release();
+        return;
+    }
+
+    string line;
+    if (!readLine(line) || (line.compare(0, 5, "FRAME") != 0))
+    {
+        frame.release();
+        return;
+    }
+
+    planes.create(resolution.height * 3 / 2, resolution.width, CV_8UC1);
+    size_t bytes = planes.total();
+    if (fread(planes.data, 1, bytes, in) != bytes)
+    {
+        frame.release();
+        return;
+    }
+
+    cv::cvtColor(planes, frame, COLOR_YUV2BGR_I420);
+}
+
+void PipeSource::grab()
+{
+    cv::Mat discarded;
+    read(discarded);
+}
+
+int PipeSource::fourcc() const
+{
+    return VideoWriter::fourcc('M', 'J', 'P', 'G');
+}
+
+std::unique_ptr<FrameSource> openSource(const std::string& reference, int frames)
+{
+    PipeSpec spec;
+    if (!parsePipeSpec(reference, spec))
+        return make_unique<CaptureSource>(reference);
+
+    if (frames <= 0)
+        throw IOError{ "Streamed input needs its frame count (-frames=N)" };
+    return make_unique<PipeSource>(spec, frames);
+}
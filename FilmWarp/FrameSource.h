@@ -0,0 +1,99 @@
+#pragma once
+
+// Where Video reads its frames from: a container file decoded through
+// cv::VideoCapture, or an uncompressed stream on a pipe or file.
+class FrameSource
+{
+public:
+    // Reads the next frame as packed BGR; `frame` is left empty at the end of the input.
+    virtual void read(cv::Mat& frame) = 0;
+    virtual void grab() = 0;
+
+    // Positions the source so that the next read returns `frame`.
+    virtual bool seek(int frame) = 0;
+    virtual bool rewind() = 0;
+
+    // A streaming source is read once from front to back; it cannot seek or rewind.
+    virtual bool streaming() const = 0;
+
+    virtual cv::Size size() const = 0;
+    virtual double fps() const = 0;
+    virtual int framecount() const = 0;
+    virtual int fourcc() const = 0;
+
+    virtual ~FrameSource() {}
+};
+
+class CaptureSource : public FrameSource
+{
+    cv::VideoCapture capture;
+    std::string      file;
+public:
+    CaptureSource(const std::string& filename);
+
+    virtual void read(cv::Mat& frame);
+    virtual void grab();
+    virtual bool seek(int frame);
+    virtual bool rewind();
+    virtual bool streaming() const { return false; }
+
+    virtual cv::Size size() const;
+    virtual double fps() const;
+    virtual int framecount() const;
+    virtual int fourcc() const;
+};
+
+// Uncompressed frame streams: YUV4MPEG2 with 4:2:0 chroma (ffmpeg's
+// `-f yuv4mpegpipe -pix_fmt yuv420p`), or packed BGR (`-f rawvideo -pix_fmt bgr24`).
+enum class PipeFormat
+{
+    Y4M,
+    BGR
+};
+
+// "y4m:path" or "bgr:WxH@fps:path", where the path "-" is stdin or stdout. Raw
+// BGR carries no header, so input streams name their size (the rate defaults to 25).
+struct PipeSpec
+{
+    PipeFormat  format;
+    cv::Size    size;
+    double      fps;
+    std::string path;
+};
+
+bool parsePipeSpec(const std::string& reference, PipeSpec& spec);
+
+// Opens `path` (or stdin/stdout for "-") in binary mode with a large buffer.
+FILE* openPipe(const std::string& path, bool output);
+void closePipe(FILE* pipe);
+
+class PipeSource : public FrameSource
+{
+    FILE*      in;
+    PipeFormat format;
+    cv::Size   resolution;
+    double     rate;
+    int        frame_count;
+    cv::Mat    planes;
+
+    bool readLine(std::string& line);
+    void readHeader();
+public:
+    // a stream does not announce its length, so the frame count comes from the caller
+    PipeSource(const PipeSpec& spec, int frames);
+    ~PipeSource();
+
+    virtual void read(cv::Mat& frame);
+    virtual void grab();
+    virtual bool seek(int) { return false; }
+    virtual bool rewind() { return false; }
+    virtual bool streaming() const { return true; }
+
+    virtual cv::Size size() const { return resolution; }
+    virtual double fps() const { return rate; }
+    virtual int framecount() const { return frame_count; }
+    virtual int fourcc() const;
+};
+
+// `frames` is only used by streams, which need it
+std::unique_ptr<FrameSource> openSource(const std::string& reference, int frames);
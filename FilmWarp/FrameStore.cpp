@@ -0,0 +1,216 @@
+#include "stdafx.h"
+#include "FrameStore.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    // frames start on a page boundary
+    const size_t header_bytes = 4096;
+    const char store_magic[8] = { 'F', 'W', 'S', 'T', 'O', 'R', 'E', '1' };
+
+    struct StoreHeader
+    {
+        char      magic[8];
+        int       width;
+        int       height;
+        int       frames;
+        int       complete;
+        long long source_size;
+        long long source_mtime;
+    };
+
+    size_t frameBytes(int width, int height)
+    {
+        return static_cast<size_t>(width) * height * 3;
+    }
+}
+
+bool fileStamp(const std::string& filename, FileStamp& stamp)
+{
+#ifdef _WIN32
+    struct _stat64 info;
+    if (_stat64(filename.c_str(), &info) != 0)
+        return false;
+#else
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0)
+        return false;
+#endif
+    stamp = FileStamp{ static_cast<long long>(info.st_size), static_cast<long long>(info.st_mtime) };
+    return true;
+}
+
+FrameStore::FrameStore() : view(nullptr), view_size(0),
+#ifdef _WIN32
+    file_handle(nullptr), mapping_handle(nullptr),
+#else
+    fd(-1),
+#endif
+    width(0), height(0), frames(0)
+{}
+
+FrameStore::~FrameStore()
+{
+    unmap();
+}
+
+// size == 0 maps an existing file whole; otherwise the file is created (or
+// truncated) with the given size
+bool FrameStore::map(const std::string& path, size_t size, bool writable)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ,
+        nullptr, writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    if (!writable)
+    {
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length) || (length.QuadPart == 0))
+        {
+            CloseHandle(file);
+            return false;
+        }
+        size = static_cast<size_t>(length.QuadPart);
+    }
+
+    unsigned long long size64 = size;
+    HANDLE mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+        static_cast<DWORD>(size64 >> 32), static_cast<DWORD>(size64 & 0xFFFFFFFFull), nullptr);
+    void* mem = mapping ? MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size) : nullptr;
+    if (!mem)
+    {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+#else
+    int file = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+    if (file < 0)
+        return false;
+
+    struct stat info;
+    bool sized = writable ? (ftruncate(file, static_cast<off_t>(size)) == 0) : (fstat(file, &info) == 0);
+    if (sized && !writable)
+        size = static_cast<size_t>(info.st_size);
+
+    void* mem = (sized && size) ? mmap(nullptr, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+    if (mem == MAP_FAILED)
+    {
+        close(file);
+        return false;
+    }
+
+    fd = file;
+#endif
+    view = mem;
+    view_size = size;
+    return true;
+}
+
+void FrameStore::unmap()
+{
+    if (!view)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+    CloseHandle(mapping_handle);
+    CloseHandle(file_handle);
+    mapping_handle = file_handle = nullptr;
+#else
+    munmap(view, view_size);
+    close(fd);
+    fd = -1;
+#endif
+    view = nullptr;
+    view_size = 0;
+    frames = 0;
+}
+
+bool FrameStore::open(const std::string& path, const FileStamp& stamp, cv::Size res)
+{
+    unmap();
+    if (!map(path, 0, false))
+        return false;
+
+    const StoreHeader* header = static_cast<const StoreHeader*>(view);
+    bool valid = (view_size >= header_bytes) &&
+        equal(begin(store_magic), end(store_magic), header->magic) &&
+        header->complete && (header->width == res.width) && (header->height == res.height) &&
+        (header->source_size == stamp.size) && (header->source_mtime == stamp.mtime) &&
+        (header->frames >= 0) &&
+        (view_size >= header_bytes + frameBytes(res.width, res.height) * header->frames);
+
+    if (!valid)
+    {
+        unmap();
+        return false;
+    }
+
+    width = res.width;
+    height = res.height;
+    frames = header->frames;
+    return true;
+}
+
+void FrameStore::create(const std::string& path, const FileStamp& stamp, cv::Size res, int capacity)
+{
+    unmap();
+    if (!map(path, header_bytes + frameBytes(res.width, res.height) * max(capacity, 0), true))
+        throw IOError{ "Could not create frame store" };
+
+    StoreHeader* header = static_cast<StoreHeader*>(view);
+    copy(begin(store_magic), end(store_magic), header->magic);
+    header->width = res.width;
+    header->height = res.height;
+    header->frames = 0;
+    header->complete = 0;
+    header->source_size = stamp.size;
+    header->source_mtime = stamp.mtime;
+
+    width = res.width;
+    height = res.height;
+    frames = max(capacity, 0);
+}
+
+void FrameStore::finish(int frame_count)
+{
+    StoreHeader* header = static_cast<StoreHeader*>(view);
+    header->frames = frame_count;
+    frames = frame_count;
+
+    // the frames have to reach the file before the store is marked usable
+#ifdef _WIN32
+    FlushViewOfFile(view, 0);
+    header->complete = 1;
+    FlushViewOfFile(view, header_bytes);
+#else
+    msync(view, view_size, MS_SYNC);
+    header->complete = 1;
+    msync(view, header_bytes, MS_SYNC);
+#endif
+}
+
+unsigned char* FrameStore::frameData(int frame) const
+{
+    return static_cast<unsigned char*>(view) + header_bytes + frameBytes(width, height) * frame;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+// Size and modification time of a source file; a store is only reused while
+// both still match the file it was built from.
+struct FileStamp
+{
+    long long size;
+    long long mtime;
+};
+
+bool fileStamp(const std::string& filename, FileStamp& stamp);
+
+// Decoded frames of one source kept as raw BGR in a memory-mapped file, so
+// later runs on the same clip read pixels straight from the mapped pages
+// instead of decoding. The file holds a one-page header followed by the frames
+// back to back.
+class FrameStore
+{
+    void*  view;
+    size_t view_size;
+#ifdef _WIN32
+    void*  file_handle;
+    void*  mapping_handle;
+#else
+    int    fd;
+#endif
+
+    int width;
+    int height;
+    int frames;
+
+    bool map(const std::string& path, size_t size, bool writable);
+    void unmap();
+public:
+    FrameStore();
+    FrameStore(const FrameStore&) = delete;
+    FrameStore& operator=(const FrameStore&) = delete;
+    ~FrameStore();
+
+    // Maps an existing store; fails if it is missing, unfinished, or was built
+    // from a different version of the source.
+    bool open(const std::string& path, const FileStamp& stamp, cv::Size res);
+
+    // Creates an empty store with room for `capacity` frames; fill them
+    // through frameData and seal the store with finish.
+    void create(const std::string& path, const FileStamp& stamp, cv::Size res, int capacity);
+    void finish(int frame_count);
+
+    bool mapped() const { return view != nullptr; }
+    int framecount() const { return frames; }
+
+    unsigned char* frameData(int frame) const;
+};
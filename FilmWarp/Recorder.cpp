@@ -17,30 +17,34 @@ VideoRecorder::VideoRecorder(std::string filename, int fourcc, double fps, cv::S
     }
 }
 
-void VideoRecorder::pushFrame(cv::Mat & frame)
+cv::Mat VideoRecorder::acquireFrame()
 {
-    dest << frame;
+    if (buffer.empty())
+        buffer.create(cv::Size(width(), height()), CV_8UC3);
+    return buffer;
 }
 
-cv::Mat VideoRecorder::getSampleFrame()
+void VideoRecorder::submitFrame(cv::Mat & frame)
 {
-    return cv::Mat(cv::Size(width(), height()), CV_8UC3);
+    dest << frame;
 }
 
 ImageRecorder::ImageRecorder(std::string filename, cv::Size res)
-    : Recorder(0, 0.0, res, 1), fname(filename)
+    : Recorder(0, 0.0, res, 1), data(res, CV_8UC3), fname(filename)
 {
 
 }
 
-void ImageRecorder::pushFrame(cv::Mat & frame)
+cv::Mat ImageRecorder::acquireFrame()
 {
-    frame.copyTo(data);
+    return data;
 }
 
-cv::Mat ImageRecorder::getSampleFrame()
+void ImageRecorder::submitFrame(cv::Mat & frame)
 {
-    return cv::Mat(cv::Size(width(), height()), CV_8UC3);
+    // only frames that were not rendered into `data` itself need copying
+    if (frame.data != data.data)
+        frame.copyTo(data);
 }
 
 ImageRecorder::~ImageRecorder()
@@ -48,3 +52,127 @@ ImageRecorder::~ImageRecorder()
     cv::InputArray res(data);
     cv::imwrite(fname, res);
 }
+
+PipeRecorder::PipeRecorder(const PipeSpec& spec, double fps, cv::Size res, int target_framecount)
+    : Recorder(0, fps, res, target_framecount), out(openPipe(spec.path, true)), format(spec.format)
+{
+    if (format == PipeFormat::BGR)
+        return;
+
+    if ((res.width % 2) || (res.height % 2))
+        throw IOError{ "YUV4MPEG2 output needs an even frame size" };
+
+    // the rate as a fraction; NTSC-style rates keep their 1001 denominator
+    if (fps <= 0.0)
+        fps = 25.0;
+    long long num = llround(fps * 1000.0), den = 1000;
+    if (abs(fps - round(fps)) < 1e-3)
+        num = llround(fps), den = 1;
+    else if (abs(fps * 1.001 - round(fps * 1.001)) < 1e-3)
+        num = llround(fps * 1.001) * 1000, den = 1001;
+
+    string header = "YUV4MPEG2 W" + to_string(res.width) + " H" + to_string(res.height) +
+        " F" + to_string(num) + ":" + to_string(den) + " Ip A1:1 C420jpeg\n";
+    write(header.data(), header.size());
+}
+
+void PipeRecorder::write(const void* data, size_t bytes)
+{
+    if (fwrite(data, 1, bytes, out) != bytes)
+        throw IOError{ "Could not write output stream" };
+}
+
+cv::Mat PipeRecorder::acquireFrame()
+{
+    if (buffer.empty())
+        buffer.create(cv::Size(width(), height()), CV_8UC3);
+    return buffer;
+}
+
+void PipeRecorder::submitFrame(cv::Mat & frame)
+{
+    if (format == PipeFormat::BGR)
+    {
+        for (int i = 0; i < frame.rows; i++)
+            write(frame.ptr(i), static_cast<size_t>(frame.cols) * 3);
+        return;
+    }
+
+    static const char frame_header[] = "FRAME\n";
+    cv::cvtColor(frame, planes, COLOR_BGR2YUV_I420);
+    write(frame_header, sizeof(frame_header) - 1);
+    write(planes.data, planes.total());
+}
+
+PipeRecorder::~PipeRecorder()
+{
+    closePipe(out);
+}
+
+AsyncRecorder::AsyncRecorder(std::unique_ptr<Recorder> sink_, int queue_length)
+    : Recorder(sink_->fourcc(), sink_->fps(), cv::Size(sink_->width(), sink_->height()), sink_->framecount()),
+    sink(move(sink_)), capacity(max(queue_length, 1)), head(0), queued(0), allocated(0), closing(false)
+{
+    queue.resize(capacity);
+    pool.reserve(capacity + 2);
+    encoder = thread([this]() { encodeLoop(); });
+}
+
+void AsyncRecorder::encodeLoop()
+{
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        frame_queued.wait(guard, [this]() { return closing || (queued > 0); });
+        if (queued == 0)
+            return;
+
+        Mat frame = queue[head];
+        guard.unlock();
+        sink->submitFrame(frame);
+        guard.lock();
+
+        queue[head].release();
+        head = (head + 1) % capacity;
+        queued--;
+        pool.push_back(frame);
+        frame_written.notify_all();
+    }
+}
+
+cv::Mat AsyncRecorder::acquireFrame()
+{
+    unique_lock<mutex> guard(lock);
+    frame_written.wait(guard, [this]() { return !pool.empty() || (allocated < capacity + 2); });
+
+    if (!pool.empty())
+    {
+        Mat buffer = pool.back();
+        pool.pop_back();
+        return buffer;
+    }
+
+    allocated++;
+    guard.unlock();
+    return Mat(cv::Size(width(), height()), CV_8UC3);
+}
+
+void AsyncRecorder::submitFrame(cv::Mat & frame)
+{
+    unique_lock<mutex> guard(lock);
+    frame_written.wait(guard, [this]() { return queued < capacity; });
+
+    queue[(head + queued) % capacity] = frame;
+    queued++;
+    frame_queued.notify_one();
+}
+
+AsyncRecorder::~AsyncRecorder()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    frame_queued.notify_one();
+    encoder.join();
+}
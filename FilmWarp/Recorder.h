@@ -1,5 +1,7 @@
 #pragma once
 
+#include "FrameSource.h"
+
 class Recorder
 {
     cv::Size resolution;
@@ -10,8 +12,12 @@ class Recorder
 public:
     Recorder(int fourcc, double fps, cv::Size res, int target_framecount);
 
-    virtual void pushFrame(cv::Mat& frame) = 0;
-    virtual cv::Mat getSampleFrame() = 0;
+    // Frames are rendered straight into buffers owned by the recorder: a frame
+    // from acquireFrame is filled in place and handed back through submitFrame,
+    // which encodes it (or queues it for encoding) without copying. An encoding
+    // recorder also accepts frames of the output size that it did not hand out.
+    virtual cv::Mat acquireFrame() = 0;
+    virtual void submitFrame(cv::Mat& frame) = 0;
 
     int width() { return resolution.width; }
     int height() { return resolution.height; }
@@ -25,10 +31,11 @@ public:
 class VideoRecorder : public Recorder
 {
     cv::VideoWriter dest;
+    cv::Mat         buffer;
 public:
     VideoRecorder(std::string filename, int fourcc, double fps, cv::Size res, int target_framecount);
-    virtual void pushFrame(cv::Mat& frame);
-    virtual cv::Mat getSampleFrame();
+    virtual cv::Mat acquireFrame();
+    virtual void submitFrame(cv::Mat& frame);
 };
 
 class ImageRecorder : public Recorder
@@ -38,7 +45,52 @@ class ImageRecorder : public Recorder
 public:
     ImageRecorder(std::string filename, cv::Size res);
 
-    virtual void pushFrame(cv::Mat& frame);
-    virtual cv::Mat getSampleFrame();
+    virtual cv::Mat acquireFrame();
+    virtual void submitFrame(cv::Mat& frame);
     virtual ~ImageRecorder();
+};
+
+// Writes uncompressed frames to a pipe or file, as YUV4MPEG2 (4:2:0) or packed BGR.
+class PipeRecorder : public Recorder
+{
+    FILE*      out;
+    PipeFormat format;
+    cv::Mat    buffer;
+    cv::Mat    planes;
+
+    void write(const void* data, size_t bytes);
+public:
+    PipeRecorder(const PipeSpec& spec, double fps, cv::Size res, int target_framecount);
+
+    virtual cv::Mat acquireFrame();
+    virtual void submitFrame(cv::Mat& frame);
+    virtual ~PipeRecorder();
+};
+
+// Encodes on a background thread. Up to queue_length submitted frames wait
+// for the encoder, so with the frame being encoded and the one being rendered
+// at most queue_length + 2 buffers exist; acquireFrame blocks until one is free.
+class AsyncRecorder : public Recorder
+{
+    std::unique_ptr<Recorder> sink;
+    std::vector<cv::Mat>      queue;
+    std::vector<cv::Mat>      pool;
+    size_t                    capacity;
+    size_t                    head;
+    size_t                    queued;
+    size_t                    allocated;
+    bool                      closing;
+
+    std::mutex              lock;
+    std::condition_variable frame_queued;
+    std::condition_variable frame_written;
+    std::thread             encoder;
+
+    void encodeLoop();
+public:
+    AsyncRecorder(std::unique_ptr<Recorder> sink_, int queue_length);
+
+    virtual cv::Mat acquireFrame();
+    virtual void submitFrame(cv::Mat& frame);
+    virtual ~AsyncRecorder();
 };
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include "stdafx.h"
+#include "Sampler.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+bool cpuSupportsAVX2()
+{
+#if defined(FW_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || ((_xgetbv(0) & 6) != 6))
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif defined(FW_X86)
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+}
+
+SamplerKind bestSampler()
+{
+    return cpuSupportsAVX2() ? SamplerKind::AVX2 : SamplerKind::Scalar;
+}
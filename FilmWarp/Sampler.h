@@ -0,0 +1,138 @@
+#pragma once
+
+#include "Video.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FW_X86
+#endif
+
+enum class SamplerKind
+{
+    Scalar,
+    AVX2,
+    Fixed
+};
+
+bool cpuSupportsAVX2();
+SamplerKind bestSampler();
+
+template<class XYT, class ZT>
+void sampleRowScalar(const Video& source, const XYT* x, const XYT* y, const ZT* z, int n, unsigned char* dst)
+{
+    for (int j = 0; j < n; ++j, dst += 3)
+    {
+        Color8 c = compress(source.pixel(x[j], y[j], z[j]));
+        dst[0] = c.r;
+        dst[1] = c.g;
+        dst[2] = c.b;
+    }
+}
+
+// Fixed-point kernel: fractional coordinates become 8-bit weights and packed
+// 0x00RRGGBB pixels are blended two channels per multiply (red and blue share
+// one word, green has its own). The two weights of a blend sum to 256, so no
+// lane overflows into its neighbour and no result needs clamping. Frames not
+// stored as packed BGR go through sampleRowScalar.
+namespace fixedpoint
+{
+    struct Tap
+    {
+        int base;
+        unsigned weight;
+    };
+
+    inline Tap tap(int v)
+    {
+        return Tap{ v, 0 };
+    }
+
+    inline Tap tap(float v)
+    {
+        int base = static_cast<int>(v);
+        return Tap{ base, static_cast<unsigned>((v - base) * 256.f) };
+    }
+
+    inline unsigned load(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+
+    inline unsigned lerp(unsigned a, unsigned b, unsigned w)
+    {
+        unsigned rb = ((a & 0xff00ff) * (256 - w) + (b & 0xff00ff) * w) >> 8;
+        unsigned g = ((a & 0x00ff00) * (256 - w) + (b & 0x00ff00) * w) >> 8;
+        return (rb & 0xff00ff) | (g & 0x00ff00);
+    }
+
+    // same blend order as Video::pixel: along x, then y
+    inline unsigned sampleFrame(const cv::Mat& f, Tap x, Tap y, int last_x, int last_y)
+    {
+        const unsigned char* p = f.ptr(y.base) + 3 * x.base;
+        int dx = (x.base < last_x) ? 3 : 0;
+
+        unsigned c = x.weight ? lerp(load(p), load(p + dx), x.weight) : load(p);
+        if (y.weight)
+        {
+            const unsigned char* q = f.ptr(std::min(y.base + 1, last_y)) + 3 * x.base;
+            c = lerp(c, x.weight ? lerp(load(q), load(q + dx), x.weight) : load(q), y.weight);
+        }
+        return c;
+    }
+}
+
+template<class XYT, class ZT>
+void sampleRowFixed(const Video& source, const XYT* x, const XYT* y, const ZT* z, int n, unsigned char* dst)
+{
+    if (source.frameFormat() != FrameFormat::BGR)
+    {
+        sampleRowScalar(source, x, y, z, n, dst);
+        return;
+    }
+
+    int last_x = source.width() - 1;
+    int last_y = source.height() - 1;
+    int last_f = source.framecount() - 1;
+
+    for (int j = 0; j < n; ++j, dst += 3)
+    {
+        fixedpoint::Tap tx = fixedpoint::tap(x[j]);
+        fixedpoint::Tap ty = fixedpoint::tap(y[j]);
+        fixedpoint::Tap tz = fixedpoint::tap(z[j]);
+
+        unsigned c = fixedpoint::sampleFrame(source.cachedFrame(tz.base), tx, ty, last_x, last_y);
+        if (tz.weight)
+        {
+            unsigned c2 = fixedpoint::sampleFrame(source.cachedFrame(std::min(tz.base + 1, last_f)), tx, ty, last_x, last_y);
+            c = fixedpoint::lerp(c, c2, tz.weight);
+        }
+
+        dst[0] = static_cast<unsigned char>(c);
+        dst[1] = static_cast<unsigned char>(c >> 8);
+        dst[2] = static_cast<unsigned char>(c >> 16);
+    }
+}
+
+#ifdef FW_X86
+void sampleRowAVX2(const Video& source, const int* x, const int* y, const int* z, int n, unsigned char* dst);
+void sampleRowAVX2(const Video& source, const int* x, const int* y, const float* z, int n, unsigned char* dst);
+void sampleRowAVX2(const Video& source, const float* x, const float* y, const int* z, int n, unsigned char* dst);
+void sampleRowAVX2(const Video& source, const float* x, const float* y, const float* z, int n, unsigned char* dst);
+#endif
+
+template<class XYT, class ZT>
+void sampleRow(SamplerKind kind, const Video& source, const XYT* x, const XYT* y, const ZT* z, int n, unsigned char* dst)
+{
+#ifdef FW_X86
+    if ((kind == SamplerKind::AVX2) && (source.frameFormat() == FrameFormat::BGR))
+    {
+        sampleRowAVX2(source, x, y, z, n, dst);
+        return;
+    }
+#endif
+    if (kind == SamplerKind::Fixed)
+    {
+        sampleRowFixed(source, x, y, z, n, dst);
+        return;
+    }
+    sampleRowScalar(source, x, y, z, n, dst);
+}
@@ -0,0 +1,228 @@
+#include "stdafx.h"
+#include "Sampler.h"
+
+#ifdef FW_X86
+
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#define FW_AVX2
+#else
+#define FW_AVX2 __attribute__((target("avx2")))
+#endif
+
+// The kernels reproduce the arithmetic of the Video::pixel overloads lane by lane
+// (same truncation, same lerp operand order, no FMA), so output is bit-identical
+// to the scalar path. Groups of 8 pixels that straddle two source frames fall
+// back to sampleRowScalar.
+
+namespace
+{
+    struct Geometry
+    {
+        int step;
+        int limit;
+        __m256i last_x;
+        __m256i last_y;
+    };
+
+    struct Axis
+    {
+        __m256i lo;
+        __m256i hi;
+        __m256  t;
+    };
+
+    struct Channels
+    {
+        __m256 c[3];
+    };
+
+    FW_AVX2 inline Geometry geometry(const Video& source, int frame)
+    {
+        const cv::Mat& f = source.cachedFrame(frame);
+        Geometry g;
+        g.step = static_cast<int>(f.step[0]);
+        g.limit = g.step * (source.height() - 1) + 3 * source.width() - 4;
+        g.last_x = _mm256_set1_epi32(source.width() - 1);
+        g.last_y = _mm256_set1_epi32(source.height() - 1);
+        return g;
+    }
+
+    // 4-byte gather of packed BGR pixels; offsets past the last full dword are
+    // pulled back and shifted so the gather never reads beyond the frame.
+    FW_AVX2 inline __m256i gatherPixels(const unsigned char* base, __m256i offsets, const Geometry& g)
+    {
+        __m256i clamped = _mm256_min_epi32(offsets, _mm256_set1_epi32(g.limit));
+        __m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(offsets, clamped), 3);
+        __m256i raw = _mm256_i32gather_epi32(reinterpret_cast<const int*>(base), clamped, 1);
+        return _mm256_srlv_epi32(raw, shift);
+    }
+
+    FW_AVX2 inline __m256i pixelOffsets(__m256i x, __m256i y, const Geometry& g)
+    {
+        return _mm256_add_epi32(_mm256_mullo_epi32(y, _mm256_set1_epi32(g.step)), _mm256_mullo_epi32(x, _mm256_set1_epi32(3)));
+    }
+
+    FW_AVX2 inline Channels unpack(__m256i px)
+    {
+        const __m256i byte = _mm256_set1_epi32(0xff);
+        Channels r;
+        r.c[0] = _mm256_cvtepi32_ps(_mm256_and_si256(px, byte));
+        r.c[1] = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 8), byte));
+        r.c[2] = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 16), byte));
+        return r;
+    }
+
+    // t*b + (1-t)*a, the operand order used by Video::pixel
+    FW_AVX2 inline Channels lerp(const Channels& a, const Channels& b, __m256 t)
+    {
+        __m256 s = _mm256_sub_ps(_mm256_set1_ps(1.f), t);
+        Channels r;
+        for (int k = 0; k < 3; k++)
+            r.c[k] = _mm256_add_ps(_mm256_mul_ps(t, b.c[k]), _mm256_mul_ps(s, a.c[k]));
+        return r;
+    }
+
+    FW_AVX2 inline __m256i compress(const Channels& c)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i top = _mm256_set1_epi32(255);
+        __m256i v0 = _mm256_max_epi32(_mm256_min_epi32(_mm256_cvttps_epi32(c.c[0]), top), zero);
+        __m256i v1 = _mm256_max_epi32(_mm256_min_epi32(_mm256_cvttps_epi32(c.c[1]), top), zero);
+        __m256i v2 = _mm256_max_epi32(_mm256_min_epi32(_mm256_cvttps_epi32(c.c[2]), top), zero);
+        return _mm256_or_si256(v0, _mm256_or_si256(_mm256_slli_epi32(v1, 8), _mm256_slli_epi32(v2, 16)));
+    }
+
+    FW_AVX2 inline void storePixels(unsigned char* dst, __m256i px)
+    {
+        const __m256i pack = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        __m256i packed = _mm256_shuffle_epi8(px, pack);
+        __m128i lo = _mm256_castsi256_si128(packed);
+        __m128i hi = _mm256_extracti128_si256(packed, 1);
+
+        int tail_lo = _mm_extract_epi32(lo, 2);
+        int tail_hi = _mm_extract_epi32(hi, 2);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), lo);
+        memcpy(dst + 8, &tail_lo, 4);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 12), hi);
+        memcpy(dst + 20, &tail_hi, 4);
+    }
+
+    FW_AVX2 inline Axis loadAxis(const int* v, __m256i)
+    {
+        Axis a;
+        a.lo = a.hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v));
+        a.t = _mm256_setzero_ps();
+        return a;
+    }
+
+    FW_AVX2 inline Axis loadAxis(const float* v, __m256i last)
+    {
+        __m256 f = _mm256_loadu_ps(v);
+        Axis a;
+        a.lo = _mm256_cvttps_epi32(f);
+        a.hi = _mm256_min_epi32(_mm256_add_epi32(a.lo, _mm256_set1_epi32(1)), last);
+        a.t = _mm256_sub_ps(f, _mm256_cvtepi32_ps(a.lo));
+        return a;
+    }
+
+    // Frame index of 8 consecutive pixels; false when they do not share one.
+    FW_AVX2 inline bool frameOf(const int* z, int, int& f1, int& f2, __m256& t)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(z));
+        __m256i eq = _mm256_cmpeq_epi32(v, _mm256_set1_epi32(z[0]));
+        f1 = f2 = z[0];
+        t = _mm256_setzero_ps();
+        return _mm256_movemask_epi8(eq) == -1;
+    }
+
+    FW_AVX2 inline bool frameOf(const float* z, int frame_count, int& f1, int& f2, __m256& t)
+    {
+        __m256 v = _mm256_loadu_ps(z);
+        __m256i i = _mm256_cvttps_epi32(v);
+        f1 = _mm256_cvtsi256_si32(i);
+        f2 = std::min(f1 + 1, frame_count - 1);
+        t = _mm256_sub_ps(v, _mm256_cvtepi32_ps(i));
+        return _mm256_movemask_epi8(_mm256_cmpeq_epi32(i, _mm256_set1_epi32(f1))) == -1;
+    }
+
+    FW_AVX2 inline Channels sampleFrame(const unsigned char* base, const Axis& ax, const Axis& ay, const Geometry& g, std::false_type)
+    {
+        return unpack(gatherPixels(base, pixelOffsets(ax.lo, ay.lo, g), g));
+    }
+
+    FW_AVX2 inline Channels sampleFrame(const unsigned char* base, const Axis& ax, const Axis& ay, const Geometry& g, std::true_type)
+    {
+        Channels c11 = unpack(gatherPixels(base, pixelOffsets(ax.lo, ay.lo, g), g));
+        Channels c21 = unpack(gatherPixels(base, pixelOffsets(ax.hi, ay.lo, g), g));
+        Channels c12 = unpack(gatherPixels(base, pixelOffsets(ax.lo, ay.hi, g), g));
+        Channels c22 = unpack(gatherPixels(base, pixelOffsets(ax.hi, ay.hi, g), g));
+
+        return lerp(lerp(c11, c21, ax.t), lerp(c12, c22, ax.t), ay.t);
+    }
+
+    template<class XYT, class ZT>
+    FW_AVX2 void sampleRowImpl(const Video& source, const XYT* x, const XYT* y, const ZT* z, int n, unsigned char* dst)
+    {
+        typedef std::integral_constant<bool, std::is_same<XYT, float>::value> bilinear;
+        const bool temporal = std::is_same<ZT, float>::value;
+
+        int j = 0;
+        for (; j + 8 <= n; j += 8)
+        {
+            int f1, f2;
+            __m256 ft;
+            if (!frameOf(z + j, source.framecount(), f1, f2, ft))
+            {
+                sampleRowScalar(source, x + j, y + j, z + j, 8, dst + 3 * j);
+                continue;
+            }
+
+            Geometry g = geometry(source, f1);
+            Axis ax = loadAxis(x + j, g.last_x);
+            Axis ay = loadAxis(y + j, g.last_y);
+            const unsigned char* base1 = source.cachedFrame(f1).data;
+
+            if (!bilinear::value && !temporal)
+            {
+                storePixels(dst + 3 * j, gatherPixels(base1, pixelOffsets(ax.lo, ay.lo, g), g));
+                continue;
+            }
+
+            Channels c = sampleFrame(base1, ax, ay, g, bilinear());
+            if (temporal)
+            {
+                const unsigned char* base2 = source.cachedFrame(f2).data;
+                c = lerp(c, sampleFrame(base2, ax, ay, g, bilinear()), ft);
+            }
+            storePixels(dst + 3 * j, compress(c));
+        }
+
+        sampleRowScalar(source, x + j, y + j, z + j, n - j, dst + 3 * j);
+    }
+}
+
+void sampleRowAVX2(const Video& source, const int* x, const int* y, const int* z, int n, unsigned char* dst)
+{
+    sampleRowImpl(source, x, y, z, n, dst);
+}
+
+void sampleRowAVX2(const Video& source, const int* x, const int* y, const float* z, int n, unsigned char* dst)
+{
+    sampleRowImpl(source, x, y, z, n, dst);
+}
+
+void sampleRowAVX2(const Video& source, const float* x, const float* y, const int* z, int n, unsigned char* dst)
+{
+    sampleRowImpl(source, x, y, z, n, dst);
+}
+
+void sampleRowAVX2(const Video& source, const float* x, const float* y, const float* z, int n, unsigned char* dst)
+{
+    sampleRowImpl(source, x, y, z, n, dst);
+}
+
+#endif
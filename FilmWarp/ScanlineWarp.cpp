@@ -0,0 +1,155 @@
+#include "stdafx.h"
+#include "ScanlineWarp.h"
+
+using namespace std;
+
+namespace
+{
+    ProjectiveForm constantForm(double value)
+    {
+        return ProjectiveForm{ { value, 0., 0. }, { 1., 0., 0. }, 0., 0., true, true };
+    }
+
+    ProjectiveForm affineForm(double a, double b, double c)
+    {
+        return ProjectiveForm{ { a, b, c }, { 1., 0., 0. }, 0., 0., true, false };
+    }
+
+    void scale(ProjectiveForm& form, double k)
+    {
+        for (auto& coef : form.num)
+            coef *= k;
+    }
+
+    bool add(ProjectiveForm& acc, const ProjectiveForm& term)
+    {
+        if (acc.affine && term.affine)
+        {
+            for (int k = 0; k < 3; k++)
+                acc.num[k] += term.num[k];
+            acc.constant = acc.constant && term.constant;
+            return true;
+        }
+
+        // n/d + c = (n + c*d)/d
+        const ProjectiveForm& ratio = acc.affine ? term : acc;
+        const ProjectiveForm& offset = acc.affine ? acc : term;
+        if (!offset.constant)
+            return false;
+
+        ProjectiveForm sum = ratio;
+        for (int k = 0; k < 3; k++)
+            sum.num[k] += offset.num[0] * ratio.den[k];
+        acc = sum;
+        return true;
+    }
+
+    bool multiply(ProjectiveForm& acc, const ProjectiveForm& factor)
+    {
+        if (factor.constant)
+        {
+            scale(acc, factor.num[0]);
+            return true;
+        }
+        if (acc.constant)
+        {
+            double k = acc.num[0];
+            acc = factor;
+            scale(acc, k);
+            return true;
+        }
+        return false;
+    }
+
+    bool divide(ProjectiveForm& acc, const ProjectiveForm& divisor)
+    {
+        if (divisor.constant)
+        {
+            scale(acc, 1. / divisor.num[0]);
+            return true;
+        }
+        if (!acc.affine || !divisor.affine)
+            return false;
+
+        for (int k = 0; k < 3; k++)
+            acc.den[k] = divisor.num[k];
+        acc.affine = false;
+        acc.constant = false;
+        return true;
+    }
+
+    bool analyze(Expression3V& expr, bool integer, ProjectiveForm& form)
+    {
+        if (!(expr.dependencies() & (VarX | VarY)))
+        {
+            form = constantForm(integer ? expr.evaluateI().data[0] : expr.evaluateF().data[0]);
+            return true;
+        }
+
+        auto& children = expr.children();
+        switch (expr.kind())
+        {
+        case ExprKind::VarX:
+            form = affineForm(0., 1., 0.);
+            return true;
+
+        case ExprKind::VarY:
+            form = affineForm(0., 0., 1.);
+            return true;
+
+        case ExprKind::Shared:
+            return analyze(static_cast<EShared&>(expr).target(), integer, form);
+
+        case ExprKind::ScaleI:
+            if (!analyze(*children[0], integer, form))
+                return false;
+            scale(form, static_cast<const EScaleI&>(expr).coefficient());
+            return true;
+
+        case ExprKind::ScaleF:
+            if (!analyze(*children[0], integer, form))
+                return false;
+            scale(form, static_cast<const EScaleF&>(expr).coefficient());
+            return true;
+
+        case ExprKind::Sum:
+        case ExprKind::Mult:
+        case ExprKind::Div:
+        {
+            if (!analyze(*children[0], integer, form))
+                return false;
+
+            for (size_t k = 1; k < children.size(); k++)
+            {
+                ProjectiveForm operand;
+                if (!analyze(*children[k], integer, operand))
+                    return false;
+
+                bool ok = (expr.kind() == ExprKind::Sum) ? add(form, operand) :
+                    ((expr.kind() == ExprKind::Mult) ? multiply(form, operand) : divide(form, operand));
+                if (!ok)
+                    return false;
+            }
+            return true;
+        }
+
+        default:
+            return false;
+        }
+    }
+}
+
+bool projectiveForm(Expression3V& expr, bool integer, ProjectiveForm& form)
+{
+    // the sampler needs coordinates inside the source, so only clamped trees qualify
+    if (expr.kind() != ExprKind::ClampI)
+        return false;
+
+    auto& clamp_expr = static_cast<const EClampI&>(expr);
+    if (!analyze(*expr.children()[0], integer, form))
+        return false;
+
+    form.low = clamp_expr.lowBound();
+    form.high = clamp_expr.highBound();
+    return true;
+}
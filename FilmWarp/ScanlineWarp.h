@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Expression3V.h"
+#include "Sampler.h"
+
+// A clamped coordinate of the form (a + b*x + c*y) / (d + e*x + f*y) with the
+// coefficients of the current frame. Affine forms keep den = {1, 0, 0}.
+struct ProjectiveForm
+{
+    double num[3];
+    double den[3];
+    double low, high;
+    bool affine;
+    bool constant;
+};
+
+// Symbolic analysis of a coordinate tree: succeeds when it is a clamp of an
+// affine form, or of a ratio of affine forms, in x and y. Subtrees without
+// x/y are evaluated through the tree (in int context when `integer` is set),
+// so z may appear anywhere in them. Whether it succeeds depends only on the
+// structure of the tree, never on the current z.
+bool projectiveForm(Expression3V& expr, bool integer, ProjectiveForm& form);
+
+// Evaluates one coordinate along a row as start + step*col (numerator and
+// denominator for projective forms), which keeps the loops free of carried
+// dependencies so they vectorize. Affine rows whose end points are inside the
+// bounds skip the clamp, as an affine row is monotonic.
+template<class T> class ScanlineCoord
+{
+    T num, num_step;
+    T den, den_step;
+    T low, high;
+    bool projective;
+    bool clamped;
+
+public:
+    ScanlineCoord(const ProjectiveForm& form, int row, int width) :
+        num(static_cast<T>(form.num[0] + form.num[2] * row)),
+        num_step(static_cast<T>(form.num[1])),
+        den(static_cast<T>(form.den[0] + form.den[2] * row)),
+        den_step(static_cast<T>(form.den[1])),
+        low(static_cast<T>(form.low)), high(static_cast<T>(form.high)),
+        projective(!form.affine)
+    {
+        double first = form.num[0] + form.num[2] * row;
+        double last = first + form.num[1] * (width - 1);
+        clamped = projective || (std::min(first, last) < form.low) || (std::max(first, last) > form.high);
+    }
+
+    bool uniform() const
+    {
+        return (num_step == 0) && (den_step == 0);
+    }
+
+    // Writes the values of columns [first, first + n); NaN maps to the low bound.
+    void fill(T* out, int first, int n) const
+    {
+        const T lo = low, hi = high;
+        if (projective)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                T col = static_cast<T>(first + k);
+                T v = (num + num_step * col) / (den + den_step * col);
+                out[k] = (v >= lo) ? ((v <= hi) ? v : hi) : lo;
+            }
+        }
+        else if (clamped)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                T v = num + num_step * static_cast<T>(first + k);
+                out[k] = (v >= lo) ? ((v <= hi) ? v : hi) : lo;
+            }
+        }
+        else
+        {
+            for (int k = 0; k < n; k++)
+                out[k] = num + num_step * static_cast<T>(first + k);
+        }
+    }
+};
+
+// Renders one output row of a projective triplet. Coordinates are produced in
+// short chunks that stay in L1 and are handed straight to the sampler.
+template<class XYT, class ZT>
+void warpRow(SamplerKind kind, const Video& source, const std::array<ProjectiveForm, 3>& forms, int row, int width, unsigned char* dst)
+{
+    const int chunk = 64;
+    XYT xs[chunk], ys[chunk];
+    ZT zs[chunk];
+
+    ScanlineCoord<XYT> x(forms[0], row, width), y(forms[1], row, width);
+    ScanlineCoord<ZT> z(forms[2], row, width);
+
+    // a coordinate that does not change along the row is only written once
+    if (x.uniform()) x.fill(xs, 0, chunk);
+    if (y.uniform()) y.fill(ys, 0, chunk);
+    if (z.uniform()) z.fill(zs, 0, chunk);
+
+    for (int j = 0; j < width; j += chunk)
+    {
+        int n = std::min(chunk, width - j);
+        if (!x.uniform()) x.fill(xs, j, n);
+        if (!y.uniform()) y.fill(ys, j, n);
+        if (!z.uniform()) z.fill(zs, j, n);
+        sampleRow(kind, source, xs, ys, zs, n, dst + 3 * j);
+    }
+}
@@ -4,22 +4,134 @@ enum class SpanType
 {
     Dense,
     Sparse,
-    SparseLinear
+    SparseLinear,
+    Affine2D    // data = {a, b, c}: value a + b*col + c*row over rows of `width` values
+};
+
+// Per-thread free list of the vectors behind SmartSpan. Spans return their
+// storage here when they die and builders take the best-fitting buffer back,
+// so once every buffer has grown to its working size a frame does not allocate.
+template<class T> class SpanPool
+{
+    static const size_t max_buffers = 64;
+    std::vector<std::vector<T>> buffers;
+
+    SpanPool() { buffers.reserve(max_buffers); }
+public:
+    static SpanPool& local()
+    {
+        thread_local SpanPool pool;
+        return pool;
+    }
+
+    std::vector<T> acquire(size_t capacity)
+    {
+        std::vector<T> v;
+        if (!buffers.empty())
+        {
+            size_t best = 0;
+            for (size_t k = 1; k < buffers.size(); k++)
+            {
+                size_t c = buffers[k].capacity();
+                size_t cb = buffers[best].capacity();
+                bool fits = (c >= capacity);
+                bool best_fits = (cb >= capacity);
+                if ((fits && (!best_fits || (c < cb))) || (!fits && !best_fits && (c > cb)))
+                    best = k;
+            }
+            std::swap(buffers[best], buffers.back());
+            v = std::move(buffers.back());
+            buffers.pop_back();
+        }
+        v.reserve(capacity);
+        return v;
+    }
+
+    void release(std::vector<T>& v)
+    {
+        if ((v.capacity() == 0) || (buffers.size() == max_buffers))
+            return;
+        v.clear();
+        buffers.push_back(std::move(v));
+    }
 };
 
 template<class T> struct SmartSpan
 {
     SpanType type;
     int      size;
+    int      width = 0;
     std::vector<T>   data;
     std::vector<int> offsets;
 
-    SmartSpan(int size_, T val = 0) : size(size_), type(SpanType::Sparse), data{ T{ val } }, offsets{ 0,size }
+    SmartSpan(int size_, T val = 0) : type(SpanType::Sparse), size(size_), data(SpanPool<T>::local().acquire(1)), offsets(SpanPool<int>::local().acquire(2))
+    {
+        data.push_back(val);
+        offsets.push_back(0);
+        offsets.push_back(size);
+    }
+
+    SmartSpan() : type(SpanType::Sparse), size(0), data{}, offsets{}
     {}
 
-    SmartSpan() : size(0), type(SpanType::Sparse), data{}, offsets{}
+    // Empty span of the given type with pooled storage for the expected segment count.
+    SmartSpan(SpanType type_, int size_, size_t data_capacity, size_t offsets_capacity) : type(type_), size(size_),
+        data(SpanPool<T>::local().acquire(data_capacity)), offsets(SpanPool<int>::local().acquire(offsets_capacity))
     {}
 
+    SmartSpan(const SmartSpan& other) : type(other.type), size(other.size), width(other.width),
+        data(SpanPool<T>::local().acquire(other.data.size())), offsets(SpanPool<int>::local().acquire(other.offsets.size()))
+    {
+        data.assign(other.data.begin(), other.data.end());
+        offsets.assign(other.offsets.begin(), other.offsets.end());
+    }
+
+    SmartSpan(SmartSpan&& other) = default;
+
+    SmartSpan& operator=(const SmartSpan& other)
+    {
+        if (this != &other)
+        {
+            size = other.size;
+            width = other.width;
+            type = other.type;
+            assignPooled(data, other.data);
+            assignPooled(offsets, other.offsets);
+        }
+        return *this;
+    }
+
+    SmartSpan& operator=(SmartSpan&& other)
+    {
+        if (this != &other)
+        {
+            size = other.size;
+            width = other.width;
+            type = other.type;
+            SpanPool<T>::local().release(data);
+            SpanPool<int>::local().release(offsets);
+            data = std::move(other.data);
+            offsets = std::move(other.offsets);
+        }
+        return *this;
+    }
+
+    ~SmartSpan()
+    {
+        SpanPool<T>::local().release(data);
+        SpanPool<int>::local().release(offsets);
+    }
+
+    template<class U> static void assignPooled(std::vector<U>& dst, const std::vector<U>& src)
+    {
+        if (dst.capacity() < src.size())
+        {
+            SpanPool<U>::local().release(dst);
+            dst = SpanPool<U>::local().acquire(src.size());
+        }
+        dst.assign(src.begin(), src.end());
+    }
+
     template<class F> void foreach_dense(F func)
     {
         for (int i = 0; i < size; i++)
@@ -31,7 +143,7 @@ template<class T> struct SmartSpan
     template<class F> void foreach_sparse(F func)
     {
         int i = 0;
-        for (int off = 0; off < offsets.size() - 1; off++)
+        for (int off = 0; off < static_cast<int>(offsets.size()) - 1; off++)
         {
             for (int j = offsets[off]; j < offsets[off + 1]; j++, i++)
             {
@@ -43,14 +155,26 @@ template<class T> struct SmartSpan
     template<class F> void foreach_sparselinear(F func)
     {
         int i = 0;
-        for (int off = 0; off < offsets.size() - 1; off++)
+        for (int off = 0; off < static_cast<int>(offsets.size()) - 1; off++)
         {
-            T val = data[2 * off];
+            T start = data[2 * off];
             T step = data[2 * off + 1];
             for (int j = offsets[off]; j < offsets[off + 1]; j++, i++)
             {
-                func(i, val);
-                val += step;
+                func(i, start + step * static_cast<T>(j - offsets[off]));
+            }
+        }
+    }
+
+    template<class F> void foreach_affine(F func)
+    {
+        int i = 0;
+        for (int row = 0; i < size; row++)
+        {
+            T start = data[0] + data[2] * static_cast<T>(row);
+            for (int j = 0; j < width; j++, i++)
+            {
+                func(i, start + data[1] * static_cast<T>(j));
             }
         }
     }
@@ -66,7 +190,7 @@ template<class T> struct SmartSpan
     template<class F> void foreach_sparse(F func) const
     {
         int i = 0;
-        for (int off = 0; off < offsets.size() - 1; off++)
+        for (int off = 0; off < static_cast<int>(offsets.size()) - 1; off++)
         {
             for (int j = offsets[off]; j < offsets[off + 1]; j++, i++)
             {
@@ -78,14 +202,26 @@ template<class T> struct SmartSpan
     template<class F> void foreach_sparselinear(F func) const
     {
         int i = 0;
-        for (int off = 0; off < offsets.size() - 1; off++)
+        for (int off = 0; off < static_cast<int>(offsets.size()) - 1; off++)
         {
-            T val = data[2 * off];
+            T start = data[2 * off];
             T step = data[2 * off + 1];
             for (int j = offsets[off]; j < offsets[off + 1]; j++, i++)
             {
-                func(i, val);
-                val += step;
+                func(i, start + step * static_cast<T>(j - offsets[off]));
+            }
+        }
+    }
+
+    template<class F> void foreach_affine(F func) const
+    {
+        int i = 0;
+        for (int row = 0; i < size; row++)
+        {
+            T start = data[0] + data[2] * static_cast<T>(row);
+            for (int j = 0; j < width; j++, i++)
+            {
+                func(i, start + data[1] * static_cast<T>(j));
             }
         }
     }
@@ -97,6 +233,7 @@ template<class T> struct SmartSpan
         case SpanType::Dense:        foreach_dense(func); break;
         case SpanType::Sparse:       foreach_sparse(func); break;
         case SpanType::SparseLinear: foreach_sparselinear(func); break;
+        case SpanType::Affine2D:     foreach_affine(func); break;
         }
     }
 
@@ -107,37 +244,89 @@ template<class T> struct SmartSpan
         case SpanType::Dense:        foreach_dense(func); break;
         case SpanType::Sparse:       foreach_sparse(func); break;
         case SpanType::SparseLinear: foreach_sparselinear(func); break;
+        case SpanType::Affine2D:     foreach_affine(func); break;
+        }
+    }
+
+    // Writes one row of an Affine2D span. Values are start + step * j rather
+    // than a running sum, which drifts along wide float rows.
+    void fill_row(int row, T* out) const
+    {
+        T start = data[0] + data[2] * static_cast<T>(row);
+        for (int j = 0; j < width; j++)
+            out[j] = start + data[1] * static_cast<T>(j);
+    }
+
+    // Expands an Affine2D span into one segment per row: constant rows when
+    // the value does not change along x, linear rows otherwise.
+    void to_rows()
+    {
+        if (type != SpanType::Affine2D) return;
+        const bool linear = (data[1] != T(0));
+        int rows = size / width;
+        std::vector<T> ndata = SpanPool<T>::local().acquire(linear ? 2 * rows : rows);
+        std::vector<int> noffsets = SpanPool<int>::local().acquire(rows + 1);
+        for (int row = 0; row < rows; row++)
+        {
+            ndata.push_back(data[0] + data[2] * static_cast<T>(row));
+            if (linear)
+                ndata.push_back(data[1]);
+            noffsets.push_back(row * width);
         }
+        noffsets.push_back(size);
+        data.swap(ndata);
+        offsets.swap(noffsets);
+        SpanPool<T>::local().release(ndata);
+        SpanPool<int>::local().release(noffsets);
+        type = linear ? SpanType::SparseLinear : SpanType::Sparse;
     }
 
     void to_dense()
     {
         if (type == SpanType::Dense) return;
-        std::vector<T> ndata(size);
+        std::vector<T> ndata = SpanPool<T>::local().acquire(size);
+        ndata.resize(size);
         foreach([&](int i, T val) {ndata[i] = val;  });
-        data = move(ndata);
+        data.swap(ndata);
+        SpanPool<T>::local().release(ndata);
         type = SpanType::Dense;
     }
 };
 
+template<class T> SmartSpan<T> affine_span(int size, int width, T a, T b, T c)
+{
+    SmartSpan<T> span(SpanType::Affine2D, size, 3, 2);
+    span.width = width;
+    span.data.assign({ a, b, c });
+    span.offsets.assign({ 0, size });
+    return span;
+}
+
 template<class T> void dense_add(SmartSpan<T>& dense_dst, const SmartSpan<T>& src)
 {
     src.foreach([&](int i, T val) { dense_dst.data[i] += val; });
 }
 
+// Value at pos of segment seg of a SparseLinear span; a segment split at pos
+// continues from here, not from its own start.
+template<class T> T linear_at(const SmartSpan<T>& span, int seg, int pos)
+{
+    return span.data[2 * seg] + span.data[2 * seg + 1] * static_cast<T>(pos - span.offsets[seg]);
+}
+
 template<class T> void sparselinear_add(SmartSpan<T>& dst, const SmartSpan<T>& src)
 {
-    SmartSpan<T> result;
-    result.type = SpanType::SparseLinear;
+    size_t segments = dst.offsets.size() + src.offsets.size();
+    SmartSpan<T> result(SpanType::SparseLinear, dst.size, 2 * segments, segments);
     result.offsets.push_back(0);
-    result.size = dst.size;
     int off1 = 1;
     int off2 = 1;
     if (src.type == SpanType::SparseLinear)
     {
-        while ((off1 < dst.offsets.size()) && (off2 < src.offsets.size()))
+        while ((off1 < static_cast<int>(dst.offsets.size())) && (off2 < static_cast<int>(src.offsets.size())))
         {
-            result.data.push_back(dst.data[2 * (off1 - 1)] + src.data[2 * (off2 - 1)]);
+            int pos = result.offsets.back();
+            result.data.push_back(linear_at(dst, off1 - 1, pos) + linear_at(src, off2 - 1, pos));
             result.data.push_back(dst.data[2 * (off1 - 1) + 1] + src.data[2 * (off2 - 1) + 1]);
 
             if (dst.offsets[off1] == src.offsets[off2])
@@ -160,9 +349,9 @@ template<class T> void sparselinear_add(SmartSpan<T>& dst, const SmartSpan<T>& s
     }
     else // src is Sparse
     {
-        while ((off1 < dst.offsets.size()) && (off2 < src.offsets.size()))
+        while ((off1 < static_cast<int>(dst.offsets.size())) && (off2 < static_cast<int>(src.offsets.size())))
         {
-            result.data.push_back(dst.data[2 * (off1 - 1)] + src.data[(off2 - 1)]);
+            result.data.push_back(linear_at(dst, off1 - 1, result.offsets.back()) + src.data[(off2 - 1)]);
             result.data.push_back(dst.data[2 * (off1 - 1) + 1]);
 
             if (dst.offsets[off1] == src.offsets[off2])
@@ -188,13 +377,12 @@ template<class T> void sparselinear_add(SmartSpan<T>& dst, const SmartSpan<T>& s
 
 template<class T, class F> void sparse_op(SmartSpan<T>& dst, const SmartSpan<T>& src, F op)
 {
-    SmartSpan<T> result;
-    result.type = SpanType::Sparse;
+    size_t segments = dst.offsets.size() + src.offsets.size();
+    SmartSpan<T> result(SpanType::Sparse, dst.size, segments, segments);
     result.offsets.push_back(0);
-    result.size = dst.size;
     int off1 = 1;
     int off2 = 1;
-    while ((off1 < dst.offsets.size()) && (off2 < src.offsets.size()))
+    while ((off1 < static_cast<int>(dst.offsets.size())) && (off2 < static_cast<int>(src.offsets.size())))
     {
         result.data.push_back(op(dst.data[off1 - 1], src.data[off2 - 1]));
 
@@ -219,30 +407,67 @@ template<class T, class F> void sparse_op(SmartSpan<T>& dst, const SmartSpan<T>&
     dst = std::move(result);
 }
 
-template<class T> SmartSpan<T> operator+(SmartSpan<T> a, SmartSpan<T> b)
+template<class T> bool is_uniform(const SmartSpan<T>& span)
+{
+    return (span.type == SpanType::Sparse) && (span.offsets.size() == 2);
+}
+
+// An affine operand stays affine against another affine span (sums only) or a
+// uniform one, which is added to the constant term or scales all three terms;
+// otherwise both are brought to the per-row form. Returns true when done.
+template<class T, class F> bool affine_op(SmartSpan<T>& a, SmartSpan<T>& b, bool additive, F op)
 {
-    if (a.type == SpanType::Dense)
+    if ((b.type == SpanType::Affine2D) && (a.type != SpanType::Affine2D))
+        std::swap(a, b);
+    if (a.type != SpanType::Affine2D)
+        return false;
+
+    if ((b.type == SpanType::Affine2D) && additive)
     {
-        dense_add(a, b);
-        return a;
+        for (int k = 0; k < 3; k++)
+            a.data[k] = op(a.data[k], b.data[k]);
+        return true;
     }
-    if (b.type == SpanType::Dense)
+
+    if (is_uniform(b))
     {
-        dense_add(b, a);
-        return b;
+        a.data[0] = op(a.data[0], b.data[0]);
+        if (!additive)
+        {
+            a.data[1] = op(a.data[1], b.data[0]);
+            a.data[2] = op(a.data[2], b.data[0]);
+        }
+        return true;
     }
-    if (a.type == SpanType::SparseLinear)
-    {
-        sparselinear_add(a, b);
+
+    a.to_rows();
+    b.to_rows();
+    return false;
+}
+
+// Addition and multiplication commute exactly, so the result is built in
+// whichever operand has the denser representation, reusing its storage.
+template<class T> SmartSpan<T>& operator+=(SmartSpan<T>& a, SmartSpan<T>&& b)
+{
+    if (affine_op(a, b, true, [](T x, T y) { return x + y; }))
         return a;
-    }
-    if (b.type == SpanType::SparseLinear)
+
+    if ((a.type != SpanType::Dense) && ((b.type == SpanType::Dense) || ((a.type == SpanType::Sparse) && (b.type == SpanType::SparseLinear))))
+        std::swap(a, b);
+
+    switch (a.type)
     {
-        sparselinear_add(b, a);
-        return b;
+    case SpanType::Dense:        dense_add(a, b); break;
+    case SpanType::SparseLinear: sparselinear_add(a, b); break;
+    case SpanType::Sparse:       sparse_op(a, b, [](T x, T y) { return x + y; }); break;
+    case SpanType::Affine2D:     a.to_dense(); dense_add(a, b); break;
     }
+    return a;
+}
 
-    sparse_op(a, b, [](T x, T y) { return x + y; });
+template<class T> SmartSpan<T> operator+(SmartSpan<T> a, SmartSpan<T> b)
+{
+    a += std::move(b);
     return a;
 }
 
@@ -261,16 +486,15 @@ template<class T> void sparselinear_mult(SmartSpan<T>& dst, const SmartSpan<T>&
     }
     else // src is Sparse
     {
-        SmartSpan<T> result;
-        result.type = SpanType::SparseLinear;
+        size_t segments = dst.offsets.size() + src.offsets.size();
+        SmartSpan<T> result(SpanType::SparseLinear, dst.size, 2 * segments, segments);
         result.offsets.push_back(0);
-        result.size = dst.size;
         int off1 = 1;
         int off2 = 1;
 
-        while ((off1 < dst.offsets.size()) && (off2 < src.offsets.size()))
+        while ((off1 < static_cast<int>(dst.offsets.size())) && (off2 < static_cast<int>(src.offsets.size())))
         {
-            result.data.push_back(dst.data[2 * (off1 - 1)] * src.data[(off2 - 1)]);
+            result.data.push_back(linear_at(dst, off1 - 1, result.offsets.back()) * src.data[(off2 - 1)]);
             result.data.push_back(dst.data[2 * (off1 - 1) + 1] * src.data[off2 - 1]);
 
             if (dst.offsets[off1] == src.offsets[off2])
@@ -296,36 +520,41 @@ template<class T> void sparselinear_mult(SmartSpan<T>& dst, const SmartSpan<T>&
 }
 
 
-template<class T> SmartSpan<T> operator*(SmartSpan<T> a, SmartSpan<T> b)
+template<class T> SmartSpan<T>& operator*=(SmartSpan<T>& a, SmartSpan<T>&& b)
 {
-    if (a.type == SpanType::Dense)
-    {
-        dense_mult(a, b);
-        return a;
-    }
-    if (b.type == SpanType::Dense)
-    {
-        dense_mult(b, a);
-        return b;
-    }
-    if (a.type == SpanType::SparseLinear)
-    {
-        sparselinear_mult(a, b);
+    if (affine_op(a, b, false, [](T x, T y) { return x * y; }))
         return a;
-    }
-    if (b.type == SpanType::SparseLinear)
+
+    if ((a.type != SpanType::Dense) && ((b.type == SpanType::Dense) || ((a.type == SpanType::Sparse) && (b.type == SpanType::SparseLinear))))
+        std::swap(a, b);
+
+    switch (a.type)
     {
-        sparselinear_mult(b, a);
-        return b;
+    case SpanType::Dense:        dense_mult(a, b); break;
+    case SpanType::SparseLinear: sparselinear_mult(a, b); break;
+    case SpanType::Sparse:       sparse_op(a, b, [](T x, T y) { return x * y; }); break;
+    case SpanType::Affine2D:     a.to_dense(); dense_mult(a, b); break;
     }
+    return a;
+}
 
-    sparse_op(a, b, [](T x, T y) { return x * y; });
+template<class T> SmartSpan<T> operator*(SmartSpan<T> a, SmartSpan<T> b)
+{
+    a *= std::move(b);
     return a;
 }
 
 
 template<class T, class F> void generic_op(SmartSpan<T>& dst, const SmartSpan<T>& src, F op)
 {
+    if (src.type == SpanType::Affine2D)
+    {
+        SmartSpan<T> rows(src);
+        rows.to_rows();
+        return generic_op(dst, rows, op);
+    }
+    dst.to_rows();
+
     if ((dst.type == SpanType::Sparse) && (src.type == SpanType::Sparse))
     {
         return sparse_op(dst, src, op);
@@ -334,3 +563,46 @@ template<class T, class F> void generic_op(SmartSpan<T>& dst, const SmartSpan<T>
     dst.to_dense();
     src.foreach([&](int i, T val) { dst.data[i] = op(dst.data[i], val); });
 }
+
+// Clamps a SparseLinear span, splitting segments where they cross a bound.
+template<class T> void sparselinear_clamp(SmartSpan<T>& vec, T low, T high)
+{
+    SmartSpan<T> result(SpanType::SparseLinear, vec.size, 2 * vec.offsets.size() + 4, vec.offsets.size() + 2);
+    result.offsets.push_back(0);
+
+    auto push_segment = [&result](T start, T step, int end)
+    {
+        result.data.push_back(start);
+        result.data.push_back(step);
+        result.offsets.push_back(end);
+    };
+
+    for (int i = 0; i < static_cast<int>(vec.offsets.size()) - 1; i++)
+    {
+        T step = vec.data[2 * i + 1];
+        int j = vec.offsets[i];
+        int end = vec.offsets[i + 1];
+
+        while (j < end)
+        {
+            T v = linear_at(vec, i, j);
+            if (v < low)
+            {
+                for (; (j < end) && (linear_at(vec, i, j) < low); j++);
+                push_segment(low, 0, j);
+            }
+            else if (v > high)
+            {
+                for (; (j < end) && (linear_at(vec, i, j) > high); j++);
+                push_segment(high, 0, j);
+            }
+            else
+            {
+                for (; (j < end) && !(linear_at(vec, i, j) < low) && !(linear_at(vec, i, j) > high); j++);
+                push_segment(v, step, j);
+            }
+        }
+    }
+
+    vec = std::move(result);
+}
@@ -11,7 +11,7 @@ std::unique_ptr<Expression3V> StringParser::readBrackets(std::string& expr)
     int bcount = 1;
     do
     {
-        if (cb >= expr.size())
+        if (cb >= static_cast<int>(expr.size()))
         {
             throw ParseError{ "Parsing error: ill-formed bracket structure" };
         }
@@ -67,7 +67,7 @@ std::unique_ptr<Expression3V> StringParser::readTerm(std::string& expr)
         expr = expr.substr(1);
         unique_ptr<Expression3V> ptr = make_unique<EScaleI>(-1);
         ptr->addChild(readTerm(expr));
-        return move(ptr);
+        return ptr;
     }
 
     if (expr[0] == 'x')
@@ -139,7 +139,7 @@ std::unique_ptr<Expression3V> StringParser::formBinaryOp(char op, std::unique_pt
 
     result->addChild(move(c1));
     result->addChild(move(c2));
-    return move(result);
+    return result;
 }
 
 std::unique_ptr<Expression3V> StringParser::parseExpressionRanked(std::string &expr, int priority)
@@ -149,7 +149,7 @@ std::unique_ptr<Expression3V> StringParser::parseExpressionRanked(std::string &e
     output = (priority<3) ? parseExpressionRanked(expr, priority + 1) : readTerm(expr);
 
     if (expr.empty() || (operatorPriority(expr[0])<priority))
-        return move(output);
+        return output;
 
     std::unique_ptr<Expression3V> tmp = move(output);
 
@@ -157,7 +157,7 @@ std::unique_ptr<Expression3V> StringParser::parseExpressionRanked(std::string &e
     {
     case 1:  output = make_unique<ESum>(); break;
     case 2:  output = make_unique<EMult>(); break;
-    case 3:  output = make_unique<EMult>(); break;
+    default: output = make_unique<EMult>(); break;
     }
 
     output->addChild(move(tmp));
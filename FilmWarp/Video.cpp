@@ -31,113 +31,352 @@ Color8 compress(Color8 c)
     return c;
 }
 
+namespace
+{
+    unsigned char saturate(int v)
+    {
+        return static_cast<unsigned char>(clamp(v, 0, 255));
+    }
+
+    // 16-bit fixed point BT.601 full range
+    void toYUV420(const cv::Mat& bgr, cv::Mat& yuv)
+    {
+        int w = bgr.cols, h = bgr.rows;
+        yuv.create(h * 3 / 2, w, CV_8UC1);
+
+        unsigned char* luma = yuv.data;
+        unsigned char* u = luma + w * h;
+        unsigned char* v = u + (w / 2) * (h / 2);
+
+        for (int y = 0; y < h; y++)
+        {
+            const unsigned char* p = bgr.ptr(y);
+            for (int x = 0; x < w; x++, p += 3)
+                luma[y * w + x] = static_cast<unsigned char>((7471 * p[0] + 38470 * p[1] + 19595 * p[2] + 32768) >> 16);
+        }
+
+        for (int y = 0; y < h / 2; y++)
+        {
+            const unsigned char* p0 = bgr.ptr(2 * y);
+            const unsigned char* p1 = bgr.ptr(2 * y + 1);
+            for (int x = 0; x < w / 2; x++, p0 += 6, p1 += 6)
+            {
+                int b = p0[0] + p0[3] + p1[0] + p1[3];
+                int g = p0[1] + p0[4] + p1[1] + p1[4];
+                int r = p0[2] + p0[5] + p1[2] + p1[5];
+                int luma4 = (7471 * b + 38470 * g + 19595 * r) >> 16;
+                u[y * (w / 2) + x] = saturate(((b - luma4) * 36962 + (512 << 16) + (1 << 17)) >> 18);
+                v[y * (w / 2) + x] = saturate(((r - luma4) * 46727 + (512 << 16) + (1 << 17)) >> 18);
+            }
+        }
+    }
+
+    Color8 yuvPixel(const cv::Mat& yuv, int w, int h, int x, int y)
+    {
+        const unsigned char* luma = yuv.data;
+        const unsigned char* u = luma + w * h;
+        const unsigned char* v = u + (w / 2) * (h / 2);
+
+        int c = (y >> 1) * (w / 2) + (x >> 1);
+        int l = (luma[y * w + x] << 16) + 32768;
+        int cu = u[c] - 128;
+        int cv = v[c] - 128;
+
+        return Color8{ saturate((l + 116130 * cu) >> 16),
+            saturate((l - 22554 * cu - 46802 * cv) >> 16),
+            saturate((l + 91881 * cv) >> 16) };
+    }
+}
+
 void Video::rewind()
 {
-    source.release();
-    source.open(file);
-    if (!source.isOpened())
+    if (!source->rewind())
         throw IOError{ "Could not rewind input file" };
     current_frame = 0;
 }
 
 void Video::readFrame()
 {
-    source >> cached_frames[current_frame++];
-    if (cached_frames[current_frame - 1].empty())
+    cv::Mat& frame = cached_frames.acquire(current_frame++);
+    decodeInto(frame);
+    if (frame.empty())
     {
-        frame_count = std::min(frame_count,current_frame-1);
+        cached_frames.release(current_frame - 1);
+        inputEnded(current_frame - 1);
     }
+
+    if (streaming())
+        cached_frames.release(current_frame - 1 - maxframes);
+}
+
+// The clamps on z were built from the announced frame count, so a source that
+// ends early cannot be rendered; its missing frames are never cached.
+void Video::inputEnded(int frame)
+{
+    throw IOError{ string(streaming() ? "Input stream" : "Input file") + " ended after " + to_string(frame) +
+        " of " + to_string(frame_count) + " frames" };
+}
+
+// Decodes the next source frame in the cache format. Only one decode runs at a
+// time (the prefetch is always finished first), so the BGR staging buffer is shared.
+void Video::decodeInto(cv::Mat& frame)
+{
+    if (format == FrameFormat::BGR)
+    {
+        source->read(frame);
+        return;
+    }
+
+    source->read(decoded);
+    if (decoded.empty())
+        frame.release();
+    else
+        toYUV420(decoded, frame);
 }
 
 bool Video::isCached(int frame)
 {
-    return cached_frames.find(frame) != cached_frames.end();
+    return cached_frames.contains(frame);
 }
 
 void Video::skipFrame()
 {
-    source.grab();
+    source->grab();
     current_frame++;
+    seek_stats.skipped++;
 }
 
-Video::Video(std::string filename) : source(filename), file(filename), current_frame(0)
+void Video::seek(int frame)
 {
-    if (!source.isOpened())
-        throw IOError{ "Could not open input file" };
+    if (streaming())
+    {
+        // a stream cannot go back, and the frames read on the way are kept for
+        // the look-back window instead of being skipped
+        if (frame < current_frame)
+            throw IOError{ "Input frame " + to_string(frame) + " has left the look-back window of the stream" };
+        while (current_frame < frame)
+            readFrame();
+        return;
+    }
 
-    resolution = Size(static_cast<int>(source.get(CAP_PROP_FRAME_WIDTH)),
-        static_cast<int>(source.get(CAP_PROP_FRAME_HEIGHT)));
+    if ((frame < current_frame) || (frame - current_frame > skip_limit))
+    {
+        // the backend seeks to the nearest keyframe at or before the target and
+        // decodes forward from there; a source that cannot do that falls back
+        // to rewinding for the rest of the run
+        if (seekable && source->seek(frame))
+        {
+            current_frame = frame;
+            seek_stats.hits++;
+            return;
+        }
+
+        seekable = false;
+        seek_stats.misses++;
+        rewind();
+    }
+
+    while (current_frame < frame)
+        skipFrame();
+}
 
-    source_fps = (source.get(CAP_PROP_FPS));
-    frame_count = static_cast<int>(source.get(CAP_PROP_FRAME_COUNT));
+Video::Video(std::string filename, int frames) : Video(openSource(filename, frames))
+{
+    file = filename;
+}
+
+Video::Video(std::unique_ptr<FrameSource> source_) : source(move(source_)), format(FrameFormat::BGR), current_frame(0), seekable(true), seek_stats{ 0, 0, 0 }
+{
+    resolution = source->size();
+    source_fps = source->fps();
+    frame_count = source->framecount();
     maxframes = frame_count;
+    codec_fourcc = source->fourcc();
+}
 
-    codec_fourcc = static_cast<int>(source.get(CAP_PROP_FOURCC));
+std::vector<Video::StagedFrame> Video::decodeAhead(std::vector<int> frames, std::vector<cv::Mat> buffers)
+{
+    std::vector<StagedFrame> staged;
+
+    for (int frame : frames)
+    {
+        seek(frame);
+
+        StagedFrame s{ current_frame++, buffers.back() };
+        buffers.pop_back();
+        decodeInto(s.image);
+        staged.push_back(s);
+    }
+
+    return staged;
 }
 
-void Video::loadFrame(int frame)
+void Video::finishPrefetch()
 {
-    if (isCached(frame))
+    if (!prefetched.valid())
         return;
 
-    if (current_frame > frame)
-        rewind();
+    for (auto& s : prefetched.get())
+    {
+        if (s.image.empty())
+            inputEnded(s.frame);
+        cached_frames.insert(s.frame, s.image);
+    }
+}
 
-    while (current_frame < frame)
-        skipFrame();
+void Video::prefetch(const std::vector<int>& frames)
+{
+    finishPrefetch();
 
-    readFrame();
+    // a stream is read on the calling thread so that every frame passes through the window
+    if (store.mapped() || streaming())
+        return;
+
+    std::vector<int> missing;
+    std::vector<cv::Mat> buffers;
+    for (int f : frames)
+    {
+        if (isCached(f))
+            continue;
+        missing.push_back(f);
+        buffers.push_back(cached_frames.recycle());
+    }
+
+    if (missing.empty())
+        return;
+
+    prefetched = std::async(std::launch::async, &Video::decodeAhead, this, move(missing), move(buffers));
 }
 
-void Video::loadFrame(int from, int to)
+void Video::loadFrame(int frame)
 {
-    while ((from < to) && (isCached(from)))
-        from++;
+    finishPrefetch();
 
-    if (from == to)
+    if (store.mapped())
         return;
 
-    if (from < current_frame)
-        rewind();
-
-    while (current_frame < from)
-        skipFrame();
+    if (isCached(frame))
+        return;
 
-    while (current_frame <= to)
-        readFrame();
+    seek(frame);
+    readFrame();
 }
 
-void Video::keepFrames(int from, int to)
+void Video::loadFrames(const std::vector<int>& frames)
 {
-    for (int f = 0; f < from; f++)
-    {
-        cached_frames.erase(f);
-    }
+    finishPrefetch();
+
+    if (store.mapped())
+        return;
 
-    for (int f = to; f < frame_count; f++)
+    for (int f : frames)
     {
-        cached_frames.erase(f);
+        if (isCached(f))
+            continue;
+
+        seek(f);
+        readFrame();
     }
 }
 
+void Video::releaseFrames(const std::vector<int>& frames)
+{
+    finishPrefetch();
+
+    // mapped frames are never evicted or recycled; the OS pages them, and
+    // streamed frames leave through the look-back window
+    if (store.mapped() || streaming())
+        return;
+
+    for (int f : frames)
+        cached_frames.release(f);
+}
+
 void Video::setMaxFrames(int mf)
 {
     maxframes = mf;
 }
 
+void Video::useStore(const std::string& path)
+{
+    finishPrefetch();
+
+    if (streaming())
+        throw IOError{ "A frame store needs a seekable input file" };
+
+    FileStamp stamp;
+    if (!fileStamp(file, stamp))
+        throw IOError{ "Could not read input file attributes for the frame store" };
+
+    if (!store.open(path, stamp, resolution))
+    {
+        if (current_frame > 0)
+            rewind();
+
+        store.create(path, stamp, resolution, frame_count);
+
+        cv::Mat decoded;
+        int stored = 0;
+        for (; stored < store.framecount(); stored++)
+        {
+            source->read(decoded);
+            if (decoded.empty())
+                break;
+            if ((decoded.size() != resolution) || (decoded.type() != CV_8UC3))
+                throw IOError{ "Input frames do not match the frame store layout" };
+            cv::Mat slot(resolution, CV_8UC3, store.frameData(stored));
+            decoded.copyTo(slot);
+        }
+
+        current_frame = stored;
+        store.finish(stored);
+    }
+
+    // the cache holds headers over the mapped pages, so pixel reads go
+    // straight to the store
+    frame_count = std::min(frame_count, store.framecount());
+    cached_frames = FrameCache();
+    for (int f = 0; f < store.framecount(); f++)
+        cached_frames.insert(f, cv::Mat(resolution, CV_8UC3, store.frameData(f)));
+}
+
+void Video::setFrameFormat(FrameFormat fmt)
+{
+    finishPrefetch();
+
+    if (store.mapped() || (fmt == format))
+        return;
+    if ((fmt == FrameFormat::YUV420) && ((resolution.width % 2) || (resolution.height % 2)))
+        return;
+
+    format = fmt;
+    cached_frames = FrameCache();
+}
+
+size_t Video::frameBytes() const
+{
+    size_t pixels = static_cast<size_t>(resolution.width) * resolution.height;
+    return (format == FrameFormat::YUV420) ? (pixels * 3 / 2) : (pixels * 3);
+}
+
 cv::Mat Video::getFrame(int frame)
 {
+    if (!isCached(frame))
+        return cv::Mat();
     return cached_frames[frame];
 }
 
-Color8 Video::pixel(int x, int y, int frame)
+Color8 Video::pixel(int x, int y, int frame) const
 {
-    auto &f = cached_frames[frame];
+    const cv::Mat& f = cached_frames[frame];
+    if (format == FrameFormat::YUV420)
+        return yuvPixel(f, resolution.width, resolution.height, x, y);
+
     unsigned char* ptr = f.data + f.step[0] * y + f.step[1] * x;
     return Color8{ ptr[0], ptr[1], ptr[2] };
 }
 
-Color32 Video::pixel(float x, int y, int frame)
+Color32 Video::pixel(float x, int y, int frame) const
 {
     int x1 = static_cast<int>(x);
     int x2 = min(x1 + 1, resolution.width - 1);
@@ -149,7 +388,7 @@ Color32 Video::pixel(float x, int y, int frame)
     return x*c2 + (1.f - x)*c1;
 }
 
-Color32 Video::pixel(float x, float y, int frame)
+Color32 Video::pixel(float x, float y, int frame) const
 {
     int y1 = static_cast<int>(y);
     int y2 = min(y1 + 1, resolution.height - 1);
@@ -161,7 +400,7 @@ Color32 Video::pixel(float x, float y, int frame)
     return y*c2 + (1.f - y)*c1;
 }
 
-Color32 Video::pixel(float x, float y, float frame)
+Color32 Video::pixel(float x, float y, float frame) const
 {
     int f1 = static_cast<int>(frame);
     int f2 = min(f1 + 1, frame_count - 1);
@@ -173,7 +412,7 @@ Color32 Video::pixel(float x, float y, float frame)
     return f*c2 + (1.f - f)*c1;
 }
 
-Color32 Video::pixel(int x, int y, float frame)
+Color32 Video::pixel(int x, int y, float frame) const
 {
     int f1 = static_cast<int>(frame);
     int f2 = min(f1 + 1, frame_count - 1);
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "FrameCache.h"
+#include "FrameStore.h"
+#include "FrameSource.h"
+
 struct Color8
 {
     unsigned char r;
@@ -20,10 +24,28 @@ Color32 operator+(Color32 c1, Color32 c2);
 Color8 compress(Color32 c);
 Color8 compress(Color8 c);
 
+// Layout of frames in the cache: packed BGR as decoded, or planar YUV 4:2:0
+// (full range BT.601, chroma averaged over 2x2 blocks) at half the size.
+enum class FrameFormat
+{
+    BGR,
+    YUV420
+};
+
+struct SeekStats
+{
+    int       hits;     // backend seeks that landed on the requested frame
+    int       misses;   // seeks that had to rewind and decode from the start
+    long long skipped;  // frames decoded and thrown away
+};
+
 class Video
 {
-    cv::VideoCapture                 source;
-    std::unordered_map<int, cv::Mat> cached_frames;
+    std::unique_ptr<FrameSource>     source;
+    FrameCache                       cached_frames;
+    FrameStore                       store;
+    FrameFormat                      format;
+    cv::Mat                          decoded;
 
     cv::Size resolution;
     double source_fps;
@@ -34,31 +56,71 @@ class Video
     int current_frame;
     std::string file;
 
+    bool      seekable;
+    SeekStats seek_stats;
+
+    struct StagedFrame
+    {
+        int     frame;
+        cv::Mat image;
+    };
+
+    std::future<std::vector<StagedFrame>> prefetched;
+
     void rewind();
     void readFrame();
+    void decodeInto(cv::Mat& frame);
+    void inputEnded(int frame);
     bool isCached(int frame);
     void skipFrame();
+    void seek(int frame);
+
+    std::vector<StagedFrame> decodeAhead(std::vector<int> frames, std::vector<cv::Mat> buffers);
+    void finishPrefetch();
 public:
-    Video(std::string filename);
+    // forward gaps up to this many frames are decoded through instead of seeked over
+    static const int skip_limit = 32;
+
+    // `frames` gives the length of streamed input, which does not announce it
+    Video(std::string filename, int frames = 0);
+    Video(std::unique_ptr<FrameSource> source_);
 
     void loadFrame(int frame);
-    void loadFrame(int from, int to);
 
-    void keepFrames(int from, int to);
+    // frame lists are ascending
+    void loadFrames(const std::vector<int>& frames);
+    void prefetch(const std::vector<int>& frames);
+    void releaseFrames(const std::vector<int>& frames);
+    // For streamed input this is also the look-back window: the last `mf`
+    // frames read stay cached, and nothing older can be loaded again.
     void setMaxFrames(int mf);
 
+    // Serves all frames from a decoded-frame store at `path`, decoding the
+    // source into it first if the store is missing or out of date.
+    void useStore(const std::string& path);
+
+    // Takes effect for frames decoded afterwards; YUV 4:2:0 needs even frame
+    // dimensions and is not used with a frame store.
+    void setFrameFormat(FrameFormat fmt);
+
     cv::Mat getFrame(int frame);
 
-    int width() { return resolution.width; }
-    int height() { return resolution.height; }
-    double fps() { return source_fps; }
-    int framecount() { return frame_count; }
-    int fourcc() { return codec_fourcc; }
-    int max_frames() { return maxframes; }
-
-    Color8 pixel(int x, int y, int frame);
-    Color32 pixel(float x, int y, int frame);
-    Color32 pixel(float x, float y, int frame);
-    Color32 pixel(float x, float y, float frame);
-    Color32 pixel(int x, int y, float frame);
+    const cv::Mat& cachedFrame(int frame) const { return cached_frames[frame]; }
+
+    int width() const { return resolution.width; }
+    int height() const { return resolution.height; }
+    double fps() const { return source_fps; }
+    int framecount() const { return frame_count; }
+    int fourcc() const { return codec_fourcc; }
+    int max_frames() const { return maxframes; }
+    bool streaming() const { return source->streaming(); }
+    SeekStats seekStats() const { return seek_stats; }
+    FrameFormat frameFormat() const { return format; }
+    size_t frameBytes() const;
+
+    Color8 pixel(int x, int y, int frame) const;
+    Color32 pixel(float x, int y, int frame) const;
+    Color32 pixel(float x, float y, int frame) const;
+    Color32 pixel(float x, float y, float frame) const;
+    Color32 pixel(int x, int y, float frame) const;
 };
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "stdafx.h"
+#include "WorkerPool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool(int threads) : task_count(0), next_task(0), pending(0), generation(0), stopping(false)
+{
+    for (int t = 1; t < threads; t++)
+        workers.emplace_back([this]() { workerLoop(); });
+}
+
+bool WorkerPool::runNext(unique_lock<mutex>& guard)
+{
+    if (next_task >= task_count)
+        return false;
+
+    int t = next_task++;
+    guard.unlock();
+    task(t);
+    guard.lock();
+
+    if (--pending == 0)
+        work_done.notify_all();
+    return true;
+}
+
+void WorkerPool::workerLoop()
+{
+    unique_lock<mutex> guard(lock);
+    unsigned seen = generation;
+    while (true)
+    {
+        work_ready.wait(guard, [&]() { return stopping || (generation != seen); });
+        if (stopping)
+            return;
+        seen = generation;
+        while (runNext(guard));
+    }
+}
+
+void WorkerPool::run(int tasks, const function<void(int)>& func)
+{
+    unique_lock<mutex> guard(lock);
+    task = func;
+    task_count = tasks;
+    next_task = 0;
+    pending = tasks;
+    generation++;
+    work_ready.notify_all();
+
+    while (runNext(guard));
+    work_done.wait(guard, [&]() { return pending == 0; });
+    task = nullptr;
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto& w : workers)
+        w.join();
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+class WorkerPool
+{
+    std::vector<std::thread> workers;
+    std::mutex               lock;
+    std::condition_variable  work_ready;
+    std::condition_variable  work_done;
+
+    std::function<void(int)> task;
+    int  task_count;
+    int  next_task;
+    int  pending;
+    unsigned generation;
+    bool stopping;
+
+    bool runNext(std::unique_lock<std::mutex>& guard);
+    void workerLoop();
+public:
+    WorkerPool(int threads);
+
+    int size() const { return static_cast<int>(workers.size()) + 1; }
+    void run(int tasks, const std::function<void(int)>& func);
+
+    ~WorkerPool();
+};
@@ -4,7 +4,9 @@
 #include "targetver.h"
 
 #include <stdio.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 
 #include <map>
 #include <algorithm>
@@ -17,11 +19,16 @@
 #include <array>
 #include <numeric>
 #include <functional>
-
-#include <opencv2\core.hpp>
-#include <opencv2\imgproc.hpp> 
-#include <opencv2\videoio.hpp>
-#include <opencv2\highgui.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp> 
+#include <opencv2/videoio.hpp>
+#include <opencv2/highgui.hpp>
 
 template<class T, class Compare>
 constexpr const T& clamp(const T& v, const T& lo, const T& hi, Compare comp)
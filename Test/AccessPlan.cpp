@@ -0,0 +1,78 @@
+#include "stdafx.h"
+#include "AccessPlan.h"
+#include "Video.h"
+#include "Check.h"
+
+#include <set>
+
+// planAccess keeps every frame an output needs resident while it renders, and
+// a frame the decoder reads on its way to a load (between two loads, or from
+// where it stands to a step's first load) is kept for later instead of being
+// decoded again: a reverse warp decodes each source frame once.
+
+using namespace std;
+
+namespace
+{
+    const int skip_limit = Video::skip_limit;
+
+    // replays the plan through a decoder that reads forward through gaps of
+    // up to skip_limit frames and seeks otherwise, the way Video does
+    int replay(const string& what, const vector<FrameNeed>& needs, const vector<AccessStep>& plan, int capacity)
+    {
+        set<int> resident;
+        int position = 0, decodes = 0;
+        bool valid = true;
+        for (const AccessStep& step : plan)
+        {
+            for (int frame : step.evict)
+                resident.erase(frame);
+            for (int frame : step.load)
+            {
+                if ((frame < position) || (frame - position > skip_limit))
+                    position = frame;
+                decodes += frame - position + 1;
+                position = frame + 1;
+                resident.insert(frame);
+            }
+
+            valid &= (static_cast<int>(resident.size()) <= capacity);
+            for (int f = step.out_begin; f < step.out_end; f++)
+                for (int frame = needs[f].first; frame <= needs[f].last; frame++)
+                    valid &= (resident.count(frame) != 0);
+        }
+        check(valid, what + ": a step's frames are not all resident, or the cache overflows");
+        return decodes;
+    }
+
+    void testDecodes(const string& what, const vector<FrameNeed>& needs, int capacity, int expected)
+    {
+        vector<AccessStep> plan = planAccess(needs, capacity, 24, skip_limit);
+        int decodes = replay(what, needs, plan, capacity);
+        check(decodes == expected, what + ": " + to_string(decodes) + " decodes, expected " + to_string(expected));
+    }
+
+    vector<FrameNeed> reverse(int frames)
+    {
+        vector<FrameNeed> needs;
+        for (int f = 0; f < frames; f++)
+            needs.push_back(FrameNeed{ frames - 1 - f, frames - 1 - f });
+        return needs;
+    }
+}
+
+int main()
+{
+    vector<FrameNeed> forward;
+    for (int f = 0; f < 100; f++)
+        forward.push_back(FrameNeed{ f, min(f + 1, 99) });
+    testDecodes("forward", forward, 128, 100);
+    testDecodes("forward, small cache", forward, 4, 100);
+
+    // the first step's loads start 16 frames into the clip; the frames read on
+    // the way are the ones the next step needs
+    testDecodes("reverse of 40", reverse(40), 128, 40);
+    testDecodes("reverse of 56", reverse(56), 128, 56);
+
+    return checkFailures() ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Assertions for the test executables: a failed check prints what was
+// expected and the test's main() returns checkFailures() != 0.
+
+inline int& checkFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+inline bool check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        printf("FAILED: %s\n", what.c_str());
+        checkFailures()++;
+    }
+    return ok;
+}
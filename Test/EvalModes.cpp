@@ -0,0 +1,163 @@
+#include "stdafx.h"
+#include "StringParser.h"
+#include "ExprOptimizer.h"
+#include "ExprJit.h"
+#include "Check.h"
+
+// The register VM and the generated native code compute the same int and
+// float coordinates as the Expression3V tree, bit for bit, over whole frames.
+//
+// Given dense x/y spans the tree applies every operation per pixel in tree
+// order, which is the reference. With the compact spans the renderer uses,
+// float ops are regrouped ((x + y) * a is kept as a*x + a*y, runs are
+// stepped), so those values are only required to agree closely; int values
+// must still be identical.
+
+using namespace std;
+
+namespace
+{
+    const int width = 67, height = 29, frames = 40;
+
+    // relative to max(1, |value|)
+    const double compact_tolerance = 1e-5;
+
+    template<class T> vector<T> evaluateTree(Expression3V& expr);
+    template<> vector<int> evaluateTree<int>(Expression3V& expr)
+    {
+        SmartSpan<int> span = expr.evaluateI();
+        span.to_dense();
+        return vector<int>(span.data.begin(), span.data.end());
+    }
+    template<> vector<float> evaluateTree<float>(Expression3V& expr)
+    {
+        SmartSpan<float> span = expr.evaluateF();
+        span.to_dense();
+        return vector<float>(span.data.begin(), span.data.end());
+    }
+
+    template<class T> bool sameBits(const vector<T>& a, const vector<T>& b)
+    {
+        return (a.size() == b.size()) && (memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+    }
+
+    struct Inputs
+    {
+        SmartSpan<int>   x, y;
+        SmartSpan<float> xf, yf;
+    };
+
+    template<class T> vector<T> evaluateWith(Expression3V& expr, Inputs& in, int f)
+    {
+        expr.setVars(&in.x, &in.y);
+        expr.setVars(&in.xf, &in.yf);
+        expr.setZ(f);
+        expr.setZ(static_cast<float>(f));
+        return evaluateTree<T>(expr);
+    }
+
+    template<class T> double maxDifference(const vector<T>& a, const vector<T>& b)
+    {
+        double worst = 0.0;
+        for (size_t i = 0; i < a.size(); i++)
+            worst = max(worst, fabs(static_cast<double>(a[i]) - static_cast<double>(b[i])) / max(1.0, fabs(static_cast<double>(a[i]))));
+        return worst;
+    }
+
+    template<class T> void compareModes(const string& what, Expression3V& expr, Inputs& dense, Inputs& compact)
+    {
+        const int pixels = width * height;
+        ExprProgram program({ &expr });
+        unique_ptr<ExprJit> jit;
+        if (ExprJit::available())
+            jit = make_unique<ExprJit>(program, is_floating_point<T>::value);
+        check(!jit || jit->compiled(), what + ": JIT failed to compile");
+
+        int vm_mismatches = 0, jit_mismatches = 0, compact_mismatches = 0;
+        double compact_error = 0.0;
+        for (int f = 0; f < frames; f += 3)
+        {
+            vector<T> reference = evaluateWith<T>(expr, dense, f);
+
+            vector<T> vm(pixels);
+            T* vm_out = vm.data();
+            ExprVM<T>(program).run(0, pixels, width, static_cast<T>(f), &vm_out);
+            vm_mismatches += !sameBits(reference, vm);
+
+            if (jit && jit->compiled())
+            {
+                vector<T> native(pixels);
+                T* native_out = native.data();
+                JitRunner<T>(*jit, width).run(0, pixels, width, static_cast<T>(f), &native_out);
+                jit_mismatches += !sameBits(reference, native);
+            }
+
+            vector<T> tree = evaluateWith<T>(expr, compact, f);
+            compact_mismatches += !sameBits(reference, tree);
+            compact_error = max(compact_error, maxDifference(reference, tree));
+        }
+
+        check(vm_mismatches == 0, what + ": VM differs from the tree on " + to_string(vm_mismatches) + " frames");
+        check(jit_mismatches == 0, what + ": JIT differs from the tree on " + to_string(jit_mismatches) + " frames");
+        if (is_integral<T>::value)
+            check(compact_mismatches == 0, what + ": compact spans differ on " + to_string(compact_mismatches) + " frames");
+        else
+            check(compact_error <= compact_tolerance, what + ": compact spans off by " + to_string(compact_error));
+    }
+
+    // prepared the way main() prepares a triplet
+    void testTriplet(const string& text)
+    {
+        StringParser sp;
+        sp.setConsts(width, height, frames);
+        array<unique_ptr<Expression3V>, 3> exprs = sp.parseExprTriplet(text);
+
+        prepareTriplet(exprs, width, height, frames);
+
+        int pixels = width * height;
+        Inputs compact{ affine_span(pixels, width, 0, 1, 0), affine_span(pixels, width, 0, 0, 1),
+            affine_span(pixels, width, 0.f, 1.f, 0.f), affine_span(pixels, width, 0.f, 0.f, 1.f) };
+        Inputs dense = compact;
+        dense.x.to_dense();
+        dense.y.to_dense();
+        dense.xf.to_dense();
+        dense.yf.to_dense();
+
+        for (int c = 0; c < 3; c++)
+        {
+            string what = text + " [" + to_string(c) + "]";
+            if (exprs[c]->isPrecise())
+                compareModes<int>(what + " as int", *exprs[c], dense, compact);
+            compareModes<float>(what + " as float", *exprs[c], dense, compact);
+        }
+    }
+}
+
+int main()
+{
+    const char* catalogue[] = {
+        "[x;h-y;z]",
+        "[x;y;z-y*0.1]",
+        "[(4*x)#w;(4*y)#h;z]",
+        "[x;y;l-z]",
+        "[x;y;z*0.25]",
+        "[x;y;(z*7)#l]",
+        "[x*0.5+3;y*0.7;z*0.5]",
+        "[(x-w/2)*(y-h/2)/40+w/2;(y-h/2)*(x-w/2)/30+h/2;z]",
+        "[-x+w-1;(y*3)_7;z+x/20]",
+        "[x;y;z*0.3+y*0.2]",
+        "[x*1.5-y*0.25;y*0.9+x*0.1;z]",
+        "[w-x;y;(z+1)#l]",
+        "[(x*3.5)#w;(y*2.5)_10;z]",
+        "[x+z*2;y-z;z]",
+        "[(x*x)/w;(y*y)/h;(x+y+z)#l]",
+        "[x+x_10;y+x#7;z]",
+        "[x*(x_16+1);(x#9)*y;z]",
+        "[(x_10)*0.5+x*0.25;y;z+x#5]",
+    };
+
+    for (const char* text : catalogue)
+        testTriplet(text);
+
+    return checkFailures() ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include "StringParser.h"
+#include "Check.h"
+
+// getImage bounds what an expression evaluates to: every value over the
+// frame at a given z lies inside the interval computed for that z (up to
+// rounding, for float expressions), which the access planner relies on to
+// decode only the source frames a warp samples.
+
+using namespace std;
+
+namespace
+{
+    const int width = 64, height = 48, frames = 40;
+
+    template<class T> void collect(SmartSpan<T> span, vector<float>& values)
+    {
+        span.to_dense();
+        for (T v : span.data)
+            values.push_back(static_cast<float>(v));
+    }
+
+    void testImage(const string& text)
+    {
+        StringParser sp;
+        sp.setConsts(width, height, frames);
+        unique_ptr<Expression3V> expr = sp.parseExpression(text);
+
+        int pixels = width * height;
+        SmartSpan<int> x = affine_span(pixels, width, 0, 1, 0);
+        SmartSpan<int> y = affine_span(pixels, width, 0, 0, 1);
+        SmartSpan<float> xf = affine_span(pixels, width, 0.f, 1.f, 0.f);
+        SmartSpan<float> yf = affine_span(pixels, width, 0.f, 0.f, 1.f);
+        expr->setVars(&x, &y);
+        expr->setVars(&xf, &yf);
+
+        Interval ix{ 0.f, static_cast<float>(width - 1) };
+        Interval iy{ 0.f, static_cast<float>(height - 1) };
+
+        int outside = 0;
+        for (int f = 0; f < frames; f++)
+        {
+            expr->setZ(f);
+            expr->setZ(static_cast<float>(f));
+
+            vector<float> values;
+            if (expr->isPrecise())
+                collect(expr->evaluateI(), values);
+            else
+                collect(expr->evaluateF(), values);
+
+            Interval iz{ static_cast<float>(f), static_cast<float>(f) };
+            Interval image = expr->getImage(ix, iy, iz);
+
+            // float spans round differently from the analysis; this is the
+            // slack FilmWarper::frameNeeds leaves for it
+            if (!expr->isPrecise())
+            {
+                image.a -= 1e-4f * (1.f + std::fabs(image.a));
+                image.b += 1e-4f * (1.f + std::fabs(image.b));
+            }
+            for (float v : values)
+                outside += (v < image.a) || (v > image.b);
+        }
+        check(outside == 0, text + ": " + to_string(outside) + " values outside getImage");
+    }
+}
+
+int main()
+{
+    const char* catalogue[] = {
+        "x/2", "(x-w/2)/(y+1)", "z/3", "(z+9)/49", "(z-20)/3", "-z/4+x/20", "z*z/40", "l/(z+1)",
+        "(z*7)#l", "(x-32)#7", "z#7", "(z-20)#7", "(z*3.5)#l",
+        "z_10", "(y*3)_7", "(z-20)_6", "z*0.3+y*0.2", "l-z", "z-y*0.1", "(x-w/2)*(y-h/2)/40+w/2",
+    };
+
+    for (const char* text : catalogue)
+        testImage(text);
+
+    return checkFailures() ? 1 : 0;
+}
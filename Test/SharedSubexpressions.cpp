@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include "ExprOptimizer.h"
+#include "Check.h"
+
+// A subtree that appears in two coordinate expressions is evaluated once per
+// pass after shareSubexpressions, and again only when its inputs change.
+
+using namespace std;
+
+namespace
+{
+    // x, or x + z, counting how often it is evaluated
+    class ECounted : public Expression3V
+    {
+        int  mask;
+        int* evals;
+    public:
+        ECounted(int mask_, int* evals_) : mask(mask_), evals(evals_) {}
+
+        virtual int dependencies() const { return mask; }
+
+        virtual SmartSpan<float> evaluateF()
+        {
+            (*evals)++;
+            SmartSpan<float> r(*xf);
+            if (mask & VarZ)
+                r += SmartSpan<float>(r.size, zf);
+            return r;
+        }
+
+        virtual SmartSpan<int> evaluateI()
+        {
+            (*evals)++;
+            SmartSpan<int> r(*xi);
+            if (mask & VarZ)
+                r += SmartSpan<int>(r.size, zi);
+            return r;
+        }
+    };
+
+    // (counted + 1) + tail
+    unique_ptr<Expression3V> occurrence(int mask, int* evals, unique_ptr<Expression3V> tail)
+    {
+        auto inner = make_unique<ESum>();
+        inner->addChild(make_unique<ECounted>(mask, evals));
+        inner->addChild(make_unique<EConstI>(1));
+
+        unique_ptr<Expression3V> outer = make_unique<ESum>();
+        outer->addChild(move(inner));
+        outer->addChild(move(tail));
+        return outer;
+    }
+
+    void testShared(int mask, int frames, int expected)
+    {
+        int evals = 0;
+        array<unique_ptr<Expression3V>, 3> exprs{ {
+            occurrence(mask, &evals, make_unique<EVarY>()),
+            occurrence(mask, &evals, make_unique<EConstI>(2)),
+            make_unique<EVarZ>() } };
+        shareSubexpressions(exprs);
+
+        int width = 8, height = 4, pixels = width * height;
+        SmartSpan<int> x = affine_span(pixels, width, 0, 1, 0);
+        SmartSpan<int> y = affine_span(pixels, width, 0, 0, 1);
+        for (auto& expr : exprs)
+            expr->setVars(&x, &y);
+
+        bool values_ok = true;
+        for (int f = 0; f < frames; f++)
+        {
+            for (auto& expr : exprs)
+                expr->setZ(f);
+
+            SmartSpan<int> r0 = exprs[0]->evaluateI();
+            SmartSpan<int> r1 = exprs[1]->evaluateI();
+            r0.to_dense();
+            r1.to_dense();
+
+            int dz = (mask & VarZ) ? f : 0;
+            for (int i = 0; i < pixels; i++)
+            {
+                int cx = i % width, cy = i / width;
+                values_ok &= (r0.data[i] == cx + dz + 1 + cy) && (r1.data[i] == cx + dz + 1 + 2);
+            }
+        }
+
+        string what = (mask & VarZ) ? "z-dependent" : "z-invariant";
+        check(values_ok, what + " shared subtree gives the unshared values");
+        check(evals == expected, what + " shared subtree evaluated " + to_string(evals) + " times, expected " + to_string(expected));
+    }
+}
+
+int main()
+{
+    // two references, evaluated once per frame or once for the whole run
+    testShared(VarX, 1, 1);
+    testShared(VarX, 3, 1);
+    testShared(VarX | VarZ, 3, 3);
+
+    return checkFailures() ? 1 : 0;
+}
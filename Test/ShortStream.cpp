@@ -0,0 +1,82 @@
+#include "stdafx.h"
+#include "Video.h"
+#include "Check.h"
+
+#include <fstream>
+
+// A piped input that ends before the frame count given with -frames stops
+// the run with an IOError naming how far it got, instead of leaving empty
+// frames in the cache for the sampler to read. YUV4MPEG2 headers other than
+// 8-bit 4:2:0 are refused up front.
+
+using namespace std;
+
+namespace
+{
+    const int width = 32, height = 16;
+
+    void writeY4M(const string& path, const string& colorspace, int frames)
+    {
+        ofstream out(path, ios::binary);
+        out << "YUV4MPEG2 W" << width << " H" << height << " F25:1 Ip A1:1 " << colorspace << "\n";
+        string planes(width * height * 3 / 2, '\x80');
+        for (int f = 0; f < frames; f++)
+            out << "FRAME\n" << planes;
+    }
+
+    void writeBGR(const string& path, int frames)
+    {
+        ofstream out(path, ios::binary);
+        out << string(static_cast<size_t>(width) * height * 3 * frames, '\x40');
+    }
+
+    // the IOError message, or "" when every announced frame could be read
+    string readAll(const string& reference, int frames)
+    {
+        try
+        {
+            Video input(reference, frames);
+            vector<int> all(frames);
+            iota(all.begin(), all.end(), 0);
+            input.loadFrames(all);
+            return "";
+        }
+        catch (const IOError& e)
+        {
+            return e.message.empty() ? "(empty message)" : e.message;
+        }
+    }
+
+    void testLength(const string& reference, int frames, const string& expected)
+    {
+        string message = readAll(reference, frames);
+        check(message == expected, reference + " as " + to_string(frames) + " frames: expected \"" + expected + "\", got \"" + message + "\"");
+    }
+}
+
+int main()
+{
+    writeY4M("short_stream.y4m", "C420jpeg", 40);
+    testLength("y4m:short_stream.y4m", 40, "");
+    testLength("y4m:short_stream.y4m", 41, "Input stream ended after 40 of 41 frames");
+
+    writeBGR("short_stream.bgr", 40);
+    string bgr = "bgr:" + to_string(width) + "x" + to_string(height) + "@25:short_stream.bgr";
+    testLength(bgr, 40, "");
+    testLength(bgr, 45, "Input stream ended after 40 of 45 frames");
+
+    for (const char* colorspace : { "C420", "C420mpeg2", "C420paldv" })
+    {
+        writeY4M("short_stream.y4m", colorspace, 2);
+        testLength("y4m:short_stream.y4m", 2, "");
+    }
+
+    writeY4M("short_stream.y4m", "C420p10", 2);
+    testLength("y4m:short_stream.y4m", 2, "Only 8-bit YUV4MPEG2 input is supported (got C420p10)");
+    writeY4M("short_stream.y4m", "C444", 2);
+    testLength("y4m:short_stream.y4m", 2, "Only 4:2:0 YUV4MPEG2 input is supported");
+
+    remove("short_stream.y4m");
+    remove("short_stream.bgr");
+    return checkFailures() ? 1 : 0;
+}
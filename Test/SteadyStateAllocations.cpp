@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "StringParser.h"
+#include "ExprOptimizer.h"
+#include "AllocCounter.h"
+#include "FilmWarp.h"
+#include "SyntheticSource.h"
+#include "NullRecorder.h"
+#include "Check.h"
+
+// Once span buffers have grown to their working size, rendering a frame does
+// not touch the heap: every frame that loads no source frames makes zero
+// calls to operator new, in each evaluation mode.
+
+using namespace std;
+
+namespace
+{
+    const int width = 96, height = 64, frames = 60;
+
+    // scanline: affine and projective triplets use the scanline kernel as they
+    // do by default, everything else is forced to the given mode
+    void testWarp(const string& text, EvalMode mode, bool scanline, const char* mode_name, int threads)
+    {
+        auto source = make_unique<SyntheticSource>(cv::Size(width, height), frames);
+        SyntheticSource* counter = source.get();
+        Video input(move(source));
+
+        StringParser sp;
+        sp.setConsts(width, height, frames);
+        array<unique_ptr<Expression3V>, 3> exprs = sp.parseExprTriplet(text);
+        prepareTriplet(exprs, width, height, frames);
+
+        FilmWarper fw;
+        fw.setEvalMode(mode);
+        fw.setScanline(scanline);
+        fw.setThreads(threads);
+
+        // the first frames grow the span buffers; after that only frames that
+        // decode source frames may allocate (the cache's frame buffers)
+        const int warmup = 2;
+        vector<size_t> allocations;
+        vector<long long> decodes;
+        allocations.reserve(frames);
+        decodes.reserve(frames);
+        size_t last_count = heapAllocationCount();
+        fw.setFrameCallback([&](int)
+        {
+            size_t now = heapAllocationCount();
+            allocations.push_back(now - last_count);
+            decodes.push_back(counter->decodes());
+            last_count = heapAllocationCount();
+        });
+
+        NullRecorder dest(cv::Size(width, height), frames);
+        fw.process(input, dest, exprs);
+
+        int allocating = 0;
+        for (size_t f = warmup; f < allocations.size(); f++)
+            if ((allocations[f] > 0) && (decodes[f] == decodes[f - 1]))
+                allocating++;
+
+        string what = text + " (" + mode_name + ", " + to_string(threads) + " threads)";
+        check(allocations.size() == frames, what + ": rendered " + to_string(allocations.size()) + " frames");
+        check(allocating == 0, what + ": " + to_string(allocating) + " steady-state frames allocated");
+    }
+}
+
+int main()
+{
+    const char* catalogue[] = {
+        "[x;h-y;z]",
+        "[x;y;z-y*0.1]",
+        "[(4*x)#w;(4*y)#h;z]",
+        "[x;y;l-z]",
+        "[x*0.5+3;y*0.7;z*0.5]",
+        "[(x-w/2)*(y-h/2)/40+w/2;(y-h/2)*(x-w/2)/30+h/2;z]",
+    };
+
+    struct Mode
+    {
+        EvalMode    eval;
+        bool        scanline;
+        const char* name;
+    };
+    const Mode modes[] = {
+        { EvalMode::Tree, false, "tree" }, { EvalMode::VM, false, "vm" }, { EvalMode::JIT, false, "jit" }, { EvalMode::Tree, true, "scanline" },
+    };
+
+    for (const char* text : catalogue)
+        for (auto& mode : modes)
+            for (int threads : { 1, 3 })
+                testWarp(text, mode.eval, mode.scanline, mode.name, threads);
+
+    return checkFailures() ? 1 : 0;
+}